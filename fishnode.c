@@ -8,6 +8,14 @@
 #include <signal.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /* ========================================================= */
 /* =================== Global Vars ========================= */
@@ -16,18 +24,80 @@ static int noprompt = 0;
 int num_forwarding_table_entries = 0;
 int my_forwarding_table_size = 0;
 
-int num_packet_ids_stored = 0;
+unsigned int num_packet_ids_stored = 0;
 int packet_ids_seen_size  = 10;
 
 int num_neighbors_stored = 0;
 int my_neighbor_table_size = 0;
+int *my_neighbor_hash; //bucket heads, twice the table size so chains stay short
+int my_neighbor_hash_size = 0;
+int neighbor_free_list = -1;
 
 int num_dv_stored = 0;
 int my_dv_table_size = 0;
 
+int dv_aggregate = 0; //summarize sibling prefixes in our advertisements
+
+int dv_batch      = 0;   //queue dv packets and apply them once per tick
+int dv_batch_tick = 100; //in ms
+
+int dv_refresh    = 19;  //seconds between full advertisements
+
+int rx_batch      = 0;   //process received frames a batch at a time
+int rx_batch_size = 32;  //flush once this many are waiting
+
+int fwd_workers   = 0;    //forwarding threads, 0 forwards on the event loop
+int fwd_ring_size = 1024; //slots in each ring between the event loop and a worker
+
+int arp_queue      = 16;  //frames that can wait on one address being resolved
+int arp_refresh    = 20;  //seconds before expiry that an entry in use is asked again, 0 is off
+int arp_glean      = 5;   //seconds between learning one address from received frames, 0 is off
+int arp_glean_rate = 50;  //new or changed mappings learned per second
+
+int bcast_rpf      = 1;   //flood a broadcast only if it came over our route back to its source
+
+int egress_sched         = 0;    //queue sent frames by class, control goes out first
+int egress_budget        = 64;   //frames sent per turn of the event loop
+int egress_control_depth = 256;
+int egress_signal_depth  = 128;
+int egress_data_depth    = 1024;
+
+int nh_pace_rate   = 0;     //bytes per second forwarded to any one next hop, 0 is unpaced
+int nh_pace_burst  = 16384; //bytes a next hop can take at once
+int nh_queue_bytes = 65536; //pool buffer bytes the frames waiting on one next hop can pin
+
+int fcmp_src_rate  = 10;  //FCMP errors per second back to any one source
+int fcmp_src_burst = 20;
+int fcmp_rate      = 100; //FCMP errors per second from the whole node
+int fcmp_burst     = 200;
+
+int fast_hello          = 0;   //sub-second neighbor liveness
+int fast_hello_interval = 100; //in ms
+int fast_hello_mult     = 3;   //missed hellos before a neighbor is down
+uint32_t fast_hello_seq      = 0;
+int fast_hello_failures = 0;
+
+int neigh_probe_min = 2;  //seconds, quiet links get probed this often at worst
+int neigh_probe_max = 60; //seconds, busy links back off to this
+int neigh_probes_sent      = 0;
+int neigh_traffic_refreshes = 0;
+
+struct adj_rib_in *my_rib_in;
+int my_rib_in_size = 0;
+
+struct next_hop_table my_fwd_hops; //forwarding entries by next hop
+struct next_hop_table my_dv_hops;  //dv entries by next hop
+struct dv_dest_table my_dv_dests;  //dv entries by destination
+int lfa_switches = 0; //forwarding entries moved onto their alternate
+int dv_triggered_updates = 0;
+int libfish_neighbor_downs = 0;
+
 struct forwarding_table_entry *my_forwarding_table;
+pthread_rwlock_t my_fwd_lock = PTHREAD_RWLOCK_INITIALIZER; //only the main thread writes, workers read under it
 struct neighbor_entry *my_neighbor_table;
 struct dv_entry *my_dv_table;
+struct adv_cache my_adv_cache;
+struct dv_batch_state my_dv_batch;
 
 
 void *stored_route_keys;
@@ -36,13 +106,26 @@ struct packet_check *packet_ids_seen;
 /* ========================================================= */
 /* =================== Helper functions! =================== */
 /* ========================================================= */
+/* monotonic milliseconds, for timers finer than the one second tables */
+uint64_t now_ms(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* spreads an address over the low bits, for the tables that hash on one.
+ * Done in host order, in network order the byte that varies most is on top
+ */
+uint32_t fnaddr_hash(fnaddr_t addr){
+	uint32_t hash = ntohl(addr) * 2654435761u;
+	return hash ^ (hash >> 16);
+}
+
 int in_neighbor_table(fnaddr_t address){
-	int i = 0;
-	for(; i < my_neighbor_table_size; i++){
-		if(my_neighbor_table[i].valid && (my_neighbor_table[i].neigh == address)){
-			my_neighbor_table[i].ttl = 120;
-			return 1;
-		}
+	int i = find_neighbor(address);
+	if(i >= 0){
+		my_neighbor_table[i].ttl = 120;
+		return 1;
 	}
 	return 0;
 }
@@ -55,14 +138,16 @@ void double_packet_id_table(){
 		//fprintf(stderr, "Unable to re-initialize packet ids seen array with %d entries! Exiting!\n", packet_ids_seen_size);
 		exit(53);
 	}
+	memset(&packet_ids_seen[packet_ids_seen_size / 2], 0, sizeof(struct packet_check) * (packet_ids_seen_size / 2));
 }
 
+/* grows up to MAX_IDS_KEPT, then the oldest ids get overwritten */
 void add_id_seen(uint32_t id, fnaddr_t src){
-	if(num_packet_ids_stored >= packet_ids_seen_size){
+	if((num_packet_ids_stored >= (unsigned int)packet_ids_seen_size) && (packet_ids_seen_size < MAX_IDS_KEPT)){
 		double_packet_id_table();
 	}	
-	packet_ids_seen[num_packet_ids_stored].packet_id = id;
-	packet_ids_seen[num_packet_ids_stored].source = src;
+	packet_ids_seen[num_packet_ids_stored % packet_ids_seen_size].packet_id = id;
+	packet_ids_seen[num_packet_ids_stored % packet_ids_seen_size].source = src;
 	num_packet_ids_stored++;	
 }
 
@@ -80,24 +165,31 @@ int received_previously(fnaddr_t src, uint32_t id){
 	return ret;
 }
 
-/* takes in the netmask ALREADY IN HOST ORDER and calculates the prefix length */
+/* calculates the prefix length of a netmask. A mask is one run of set bits,
+ * so counting them works in either byte order
+ */
 int find_prefix_length(uint32_t netmask){
-	int length = 0;
-	while(netmask > 0){
-		netmask = netmask >> 1;
-		length++;
-	}	
-	//fprintf(stderr, "\tPrefix length is %d\n", length);
-	return length;
+	return __builtin_popcount(netmask);
+}
+
+/* builds a HOST ORDER netmask with the top prefix_length bits set */
+uint32_t prefix_length_to_mask(int prefix_length){
+	if(prefix_length <= 0){
+		return 0;
+	}
+	if(prefix_length >= 32){
+		return 0xFFFFFFFF;
+	}
+	return 0xFFFFFFFF << (32 - prefix_length);
 }
 
 /* ========================================================= */
 /* ============ Overriding Forwarding table Funcs ========= */
 /* ========================================================= */
-int in_forwarding_table(fnaddr_t dest){
+int in_forwarding_table(fnaddr_t dest, int prefix_length){
 	int present = 0, i = 0;
 	for(; i < my_forwarding_table_size; i++){
-		if(my_forwarding_table[i].valid && (my_forwarding_table[i].dest == dest)){
+		if(my_forwarding_table[i].valid && (my_forwarding_table[i].dest == dest) && (my_forwarding_table[i].prefix_length == prefix_length)){
 			return 1; 
 		}
 	}
@@ -111,8 +203,8 @@ void print_my_forwarding_table(){
 	"  N = Neighbor, D = Distance-Vector, Z = Link-State,             \n"
 	"                      > = Best                                   \n"
 	"=================================================================\n"
-	" T      Destination            Next Hop       Metric   Pkt Cnt   \n"
-	" - --------------------   -----------------   ------   -------   \n");
+	" T      Destination            Next Hop       Metric   Pkt Cnt       Alternate    \n"
+	" - --------------------   -----------------   ------   -------   -----------------\n");
 
 	int i = 0;
 	for(; i < my_forwarding_table_size; i++){
@@ -122,28 +214,340 @@ void print_my_forwarding_table(){
 				my_forwarding_table[i].is_best,
 				fn_ntoa(my_forwarding_table[i].dest),
 				my_forwarding_table[i].prefix_length);
-			fprintf(stdout,	"%19s   %6d    %6d  \n",
+			fprintf(stdout,	"%19s   %6d    %6d  ",
 				fn_ntoa(my_forwarding_table[i].next_hop),
 				my_forwarding_table[i].metric,
 				my_forwarding_table[i].pkt_count);
+			if(my_forwarding_table[i].alt_next_hop){
+				fprintf(stdout, "%17s (%d)", fn_ntoa(my_forwarding_table[i].alt_next_hop), my_forwarding_table[i].alt_metric);
+			}
+			fprintf(stdout, "\n");
 		}
 	}
+	fprintf(stdout, "%d routes moved to their loop free alternate\n", lfa_switches);
 }
 
 /* resize forwarding table, exit if unable to malloc for more space
  * DOUBLES in size each time!
  */
 void resize_forwarding_table(){
+	uintptr_t old_table = (uintptr_t)my_forwarding_table;
+	int i = 0;
 	my_forwarding_table_size *= 2;
 	my_forwarding_table = realloc(my_forwarding_table, sizeof(struct forwarding_table_entry) * my_forwarding_table_size);
 	if(my_forwarding_table == NULL){
 		exit(722);
 	}
+	//route keys handed out before are addresses in the old table, move them along
+	for(; i < my_dv_table_size; i++){
+		if(my_dv_table[i].fwd_table_ptr != NULL){
+			my_dv_table[i].fwd_table_ptr = my_forwarding_table + ((uintptr_t)my_dv_table[i].fwd_table_ptr - old_table) / sizeof(struct forwarding_table_entry);
+		}
+	}
+	for(i = 0; i < my_dv_batch.num_touched; i++){
+		if(my_dv_batch.touched[i].kept != NULL){
+			my_dv_batch.touched[i].kept = my_forwarding_table + ((uintptr_t)my_dv_batch.touched[i].kept - old_table) / sizeof(struct forwarding_table_entry);
+		}
+	}
+	memset(&my_forwarding_table[my_forwarding_table_size / 2], 0, (my_forwarding_table_size / 2) * sizeof(struct forwarding_table_entry));
+}
+
+/* ========================================================= */
+/* ================== Next Hop Index ======================= */
+/* ========================================================= */
+/* forwarding and dv entries are chained by next hop (through indexes, so a
+ * resize doesn't break them) so losing a neighbor only touches its own routes
+ */
+struct next_hop_index *find_next_hop(struct next_hop_table *table, fnaddr_t next_hop, int create){
+	int i = 0, empty = -1;
+	for(; i < table->size; i++){
+		if(table->hops[i].count && (table->hops[i].next_hop == next_hop)){
+			return &table->hops[i];
+		}
+		if(!table->hops[i].count && (empty < 0)){
+			empty = i;
+		}
+	}
+	if(!create){
+		return NULL;
+	}
+	if(empty < 0){
+		empty = table->size;
+		table->size = (table->size == 0) ? 16 : table->size * 2;
+		table->hops = realloc(table->hops, table->size * sizeof(struct next_hop_index));
+		if(table->hops == NULL){
+			exit(4201);
+		}
+		memset(&table->hops[empty], 0, (table->size - empty) * sizeof(struct next_hop_index));
+	}
+	table->hops[empty].next_hop = next_hop;
+	table->hops[empty].head     = -1;
+	return &table->hops[empty];
+}
+
+void link_next_hop(int index){
+	struct next_hop_index *hop = find_next_hop(&my_fwd_hops, my_forwarding_table[index].next_hop, 1);
+	my_forwarding_table[index].hop_prev = -1;
+	my_forwarding_table[index].hop_next = hop->head;
+	if(hop->head >= 0){
+		my_forwarding_table[hop->head].hop_prev = index;
+	}
+	hop->head = index;
+	hop->count++;
+}
+
+void unlink_next_hop(int index){
+	struct next_hop_index *hop = find_next_hop(&my_fwd_hops, my_forwarding_table[index].next_hop, 0);
+	if(hop == NULL){
+		return;
+	}
+	if(my_forwarding_table[index].hop_prev >= 0){
+		my_forwarding_table[my_forwarding_table[index].hop_prev].hop_next = my_forwarding_table[index].hop_next;
+	}
+	else{
+		hop->head = my_forwarding_table[index].hop_next;
+	}
+	if(my_forwarding_table[index].hop_next >= 0){
+		my_forwarding_table[my_forwarding_table[index].hop_next].hop_prev = my_forwarding_table[index].hop_prev;
+	}
+	hop->count--;
+}
+
+/* data path half of a neighbor going down: every route through it that has a
+ * loop free alternate starts using it right away, the routing side catches up after
+ */
+void fast_reroute(fnaddr_t neighbor){
+	struct next_hop_index *hop = find_next_hop(&my_fwd_hops, neighbor, 0);
+	struct forwarding_table_entry *entry = NULL;
+	int index = 0, next = 0;
+	if(hop == NULL){
+		return;
+	}
+	pthread_rwlock_wrlock(&my_fwd_lock);
+	for(index = hop->head; index >= 0; index = next){
+		entry = &my_forwarding_table[index];
+		next = entry->hop_next;
+		if(!entry->alt_next_hop || (entry->alt_next_hop == neighbor)){
+			continue;
+		}
+		unlink_next_hop(index);
+		entry->next_hop     = entry->alt_next_hop;
+		entry->metric       = entry->alt_metric;
+		entry->alt_next_hop = 0;
+		link_next_hop(index);
+		lfa_switches++;
+	}
+	pthread_rwlock_unlock(&my_fwd_lock);
 }
 
 /* ========================================================= */
 /* ================ DV Routing Implementation ============== */ 
 /* ========================================================= */
+/* routes live three refresh periods, and never less than the 3 minutes the spec asks for */
+int dv_route_ttl(){
+	if(dv_refresh * 3 > 180){
+		return dv_refresh * 3;
+	}
+	return 180;
+}
+
+void link_dv_next_hop(int index){
+	struct next_hop_index *hop = find_next_hop(&my_dv_hops, my_dv_table[index].next_hop, 1);
+	my_dv_table[index].hop_prev = -1;
+	my_dv_table[index].hop_next = hop->head;
+	if(hop->head >= 0){
+		my_dv_table[hop->head].hop_prev = index;
+	}
+	hop->head = index;
+	hop->count++;
+}
+
+/* call right as an entry stops being valid */
+void unlink_dv_next_hop(int index){
+	struct next_hop_index *hop = find_next_hop(&my_dv_hops, my_dv_table[index].next_hop, 0);
+	if(hop == NULL){
+		return;
+	}
+	if(my_dv_table[index].hop_prev >= 0){
+		my_dv_table[my_dv_table[index].hop_prev].hop_next = my_dv_table[index].hop_next;
+	}
+	else{
+		hop->head = my_dv_table[index].hop_next;
+	}
+	if(my_dv_table[index].hop_next >= 0){
+		my_dv_table[my_dv_table[index].hop_next].hop_prev = my_dv_table[index].hop_prev;
+	}
+	hop->count--;
+}
+
+/* destinations hash to a chain of dest records, and each record chains its
+ * dv entries, so everything about one destination is found without a scan
+ * of the whole dv table
+ */
+int dv_dest_bucket(fnaddr_t dest, fnaddr_t netmask){
+	return (fnaddr_hash(dest) ^ fnaddr_hash(netmask ^ 0x5bd1e995)) & (my_dv_dests.hash_size - 1);
+}
+
+/* returns the dest record for dest/netmask, or -1 */
+int find_dv_dest(fnaddr_t dest, fnaddr_t netmask){
+	int i = -1;
+	if(my_dv_dests.hash_size == 0){
+		return -1;
+	}
+	for(i = my_dv_dests.hash[dv_dest_bucket(dest, netmask)]; i >= 0; i = my_dv_dests.dests[i].hash_next){
+		if((my_dv_dests.dests[i].dest == dest) && (my_dv_dests.dests[i].netmask == netmask)){
+			break;
+		}
+	}
+	return i;
+}
+
+void grow_dv_dests(){
+	int old_size = my_dv_dests.size, i = 0, bucket = 0;
+	my_dv_dests.size = (old_size == 0) ? 64 : old_size * 2;
+	my_dv_dests.dests = realloc(my_dv_dests.dests, my_dv_dests.size * sizeof(struct dv_dest));
+	if(my_dv_dests.dests == NULL){
+		exit(2701);
+	}
+	memset(&my_dv_dests.dests[old_size], 0, (my_dv_dests.size - old_size) * sizeof(struct dv_dest));
+	if(old_size == 0){
+		my_dv_dests.free_list = -1;
+	}
+	for(i = my_dv_dests.size - 1; i >= old_size; i--){
+		my_dv_dests.dests[i].free_next = my_dv_dests.free_list;
+		my_dv_dests.free_list = i;
+	}
+	//rehash everything into a table twice the size
+	free(my_dv_dests.hash);
+	my_dv_dests.hash_size = my_dv_dests.size * 2;
+	my_dv_dests.hash = malloc(my_dv_dests.hash_size * sizeof(int));
+	if(my_dv_dests.hash == NULL){
+		exit(2702);
+	}
+	memset(my_dv_dests.hash, 0xFF, my_dv_dests.hash_size * sizeof(int)); //all -1
+	for(i = 0; i < old_size; i++){
+		if(my_dv_dests.dests[i].count || (my_dv_dests.dests[i].touched >= 0)){
+			bucket = dv_dest_bucket(my_dv_dests.dests[i].dest, my_dv_dests.dests[i].netmask);
+			my_dv_dests.dests[i].hash_next = my_dv_dests.hash[bucket];
+			my_dv_dests.hash[bucket] = i;
+		}
+	}
+}
+
+/* call right as an entry becomes valid */
+void link_dv_dest(int index){
+	int d = find_dv_dest(my_dv_table[index].dest, my_dv_table[index].netmask), bucket = 0;
+	if(d < 0){
+		if((my_dv_dests.size == 0) || (my_dv_dests.free_list < 0)){
+			grow_dv_dests();
+		}
+		d = my_dv_dests.free_list;
+		my_dv_dests.free_list = my_dv_dests.dests[d].free_next;
+		memset(&my_dv_dests.dests[d], 0, sizeof(struct dv_dest));
+		my_dv_dests.dests[d].dest    = my_dv_table[index].dest;
+		my_dv_dests.dests[d].netmask = my_dv_table[index].netmask;
+		my_dv_dests.dests[d].head    = -1;
+		my_dv_dests.dests[d].touched = -1;
+		bucket = dv_dest_bucket(my_dv_table[index].dest, my_dv_table[index].netmask);
+		my_dv_dests.dests[d].hash_next = my_dv_dests.hash[bucket];
+		my_dv_dests.hash[bucket] = d;
+		my_dv_dests.num_dests++;
+	}
+	my_dv_table[index].dest_prev = -1;
+	my_dv_table[index].dest_next = my_dv_dests.dests[d].head;
+	if(my_dv_dests.dests[d].head >= 0){
+		my_dv_table[my_dv_dests.dests[d].head].dest_prev = index;
+	}
+	my_dv_dests.dests[d].head = index;
+	my_dv_dests.dests[d].count++;
+}
+
+/* takes a record with no entries left out of the hash and onto the free list */
+void free_dv_dest(int d){
+	int *link = &my_dv_dests.hash[dv_dest_bucket(my_dv_dests.dests[d].dest, my_dv_dests.dests[d].netmask)];
+	while(*link != d){
+		link = &my_dv_dests.dests[*link].hash_next;
+	}
+	*link = my_dv_dests.dests[d].hash_next;
+	my_dv_dests.dests[d].alt_pending = 0; //a queued flush skips it
+	my_dv_dests.dests[d].free_next = my_dv_dests.free_list;
+	my_dv_dests.free_list = d;
+	my_dv_dests.num_dests--;
+}
+
+/* call right as an entry stops being valid, the record goes with its last
+ * entry unless a running batch still has to reconcile it
+ */
+void unlink_dv_dest(int index){
+	int d = find_dv_dest(my_dv_table[index].dest, my_dv_table[index].netmask);
+	if(d < 0){
+		return;
+	}
+	if(my_dv_table[index].dest_prev >= 0){
+		my_dv_table[my_dv_table[index].dest_prev].dest_next = my_dv_table[index].dest_next;
+	}
+	else{
+		my_dv_dests.dests[d].head = my_dv_table[index].dest_next;
+	}
+	if(my_dv_table[index].dest_next >= 0){
+		my_dv_table[my_dv_table[index].dest_next].dest_prev = my_dv_table[index].dest_prev;
+	}
+	if((--my_dv_dests.dests[d].count > 0) || (my_dv_dests.dests[d].touched >= 0)){
+		return;
+	}
+	free_dv_dest(d);
+}
+
+/* while a batch runs, forwarding table writes only remember the destination,
+ * dv_batch_reconcile() then applies the net change for each one. Its dest
+ * record points back at the touched slot, so a repeat costs one lookup
+ */
+void dv_batch_touch(struct dv_entry *entry){
+	int d = find_dv_dest(entry->dest, entry->netmask);
+	if(d < 0){
+		return; //entries are written to the forwarding table only while linked
+	}
+	if(my_dv_dests.dests[d].touched >= 0){
+		return;
+	}
+	if(my_dv_batch.num_touched >= my_dv_batch.touched_size){
+		my_dv_batch.touched_size = (my_dv_batch.touched_size == 0) ? 64 : my_dv_batch.touched_size * 2;
+		my_dv_batch.touched = realloc(my_dv_batch.touched, my_dv_batch.touched_size * sizeof(struct dv_touched));
+		if(my_dv_batch.touched == NULL){
+			exit(4001);
+		}
+	}
+	my_dv_batch.touched[my_dv_batch.num_touched].dest    = entry->dest;
+	my_dv_batch.touched[my_dv_batch.num_touched].netmask = entry->netmask;
+	my_dv_batch.touched[my_dv_batch.num_touched].d       = d;
+	my_dv_dests.dests[d].touched = my_dv_batch.num_touched;
+	my_dv_batch.num_touched++;
+}
+
+void *dv_fwd_add(struct dv_entry *entry){
+	if(my_dv_batch.running){
+		dv_batch_touch(entry);
+		return NULL;
+	}
+	return fish_fwd.add_fwtable_entry(entry->dest, find_prefix_length(entry->netmask), entry->next_hop, entry->metric - 1, 'D', 0);
+}
+
+void dv_fwd_remove(struct dv_entry *entry){
+	if(my_dv_batch.running){
+		dv_batch_touch(entry);
+		return;
+	}
+	fish_fwd.remove_fwtable_entry(entry->fwd_table_ptr);
+}
+
+void dv_fwd_update(struct dv_entry *entry, int new_metric){
+	if(my_dv_batch.running){
+		dv_batch_touch(entry);
+		return;
+	}
+	fish_fwd.update_fwtable_metric(entry->fwd_table_ptr, new_metric);
+}
+
 void replace_forwarding_table(struct dv_entry *entry, int current_metric){
 	//look for another entry that is valid in the dv table that matches dest
 	int replaced = 0;
@@ -153,7 +557,7 @@ void replace_forwarding_table(struct dv_entry *entry, int current_metric){
 	int i = 0;
 	for(; i < my_dv_table_size; i++){
 		//must be: valid, match the entry's destination, and be a backup route to replace the original
-		if(my_dv_table[i].valid && (my_dv_table[i].dest == entry->dest) && (my_dv_table[i].state == 'B')){
+		if(my_dv_table[i].valid && (my_dv_table[i].dest == entry->dest) && (my_dv_table[i].netmask == entry->netmask) && (my_dv_table[i].state == 'B')){
 		  	//there could be multiple backups, take the best one!
 			if(my_dv_table[i].metric < best_metric){
 				best_backup = &my_dv_table[i];
@@ -164,7 +568,9 @@ void replace_forwarding_table(struct dv_entry *entry, int current_metric){
 	}
 	if(!replaced){
 		fprintf(stderr, "%s was removed from the forwarding table and there was no backup!\n\n", fn_ntoa(entry->dest));
-		fish_fwd.remove_fwtable_entry(entry->fwd_table_ptr);
+		dv_fwd_remove(entry);
+		unlink_dv_next_hop(entry - my_dv_table);
+		unlink_dv_dest(entry - my_dv_table);
 		entry->valid = 0;
 		entry->in_forwarding_table = 0;
 	}
@@ -180,13 +586,9 @@ void replace_forwarding_table(struct dv_entry *entry, int current_metric){
 
 		best_backup->state = 'A';
 		best_backup->in_forwarding_table = 1;
-		best_backup->fwd_table_ptr = fish_fwd.add_fwtable_entry(best_backup->dest, 
-									  best_backup->netmask, 
-									  best_backup->next_hop, 
-									  best_backup->metric - 1, 
-									  'D', 
-									  0);
+		best_backup->fwd_table_ptr = dv_fwd_add(best_backup);
 	}
+	dv_entry_changed(entry); //covers best_backup too, same destination
 }
 
 void print_my_dv_table(){
@@ -202,6 +604,21 @@ void print_my_dv_table(){
 			fprintf(stdout, "%20s   %4d  %4d\n", fn_ntoa(my_dv_table[i].next_hop), my_dv_table[i].metric, my_dv_table[i].ttl);
 		}
 	}
+	//only reports the cache, bringing it up to date is left to the next advertisement
+	fprintf(stdout, "Advertising %d routes in %d records, %d entries changed since\n",
+		my_adv_cache.num_cands, my_adv_cache.num_wire, my_adv_cache.num_dirty);
+	if(dv_batch){
+		fprintf(stdout, "Batched %d dv packets into %d ticks with %d forwarding table writes\n", 
+			my_dv_batch.packets_queued, my_dv_batch.batches_run, my_dv_batch.fwd_writes);
+	}
+}
+
+/* new entries start out empty and not advertised */
+void init_dv_entries(int first, int last){
+	memset(&my_dv_table[first], 0, (last - first) * sizeof(struct dv_entry));
+	for(; first < last; first++){
+		my_dv_table[first].adv_slot = -1;
+	}
 }
 
 void resize_dv_table(){
@@ -211,6 +628,7 @@ void resize_dv_table(){
        	if(my_dv_table == NULL){
 		exit(1231);
 	}
+	init_dv_entries(my_dv_table_size / 2, my_dv_table_size);
 }
 
 
@@ -229,8 +647,9 @@ void update_dv_table(struct dv_entry *entry, int new_metric){
 		entry->metric = new_metric + 1;
 	}
 	if(entry->in_forwarding_table){
-		fish_fwd.update_fwtable_metric(entry->fwd_table_ptr, new_metric + 1);
+		dv_fwd_update(entry, new_metric + 1);
 	}
+	dv_entry_changed(entry);
 }
 
 
@@ -240,7 +659,7 @@ void update_dv_table(struct dv_entry *entry, int new_metric){
  * 	 2 if we need to add a backup
  * 	 3 if already present
  */
-int in_dv_table(fnaddr_t dest, fnaddr_t next_hop, int metric){
+int in_dv_table(fnaddr_t dest, fnaddr_t netmask, fnaddr_t next_hop, int metric){
 	int present = 0, i = 0;
 	if(metric != MAX_TTL){
 		metric++;
@@ -253,7 +672,7 @@ int in_dv_table(fnaddr_t dest, fnaddr_t next_hop, int metric){
 		//only check valid entries
 		if(my_dv_table[i].valid){
 			//check if duplicate 
-			if((my_dv_table[i].dest == dest) && (my_dv_table[i].next_hop == next_hop)){
+			if((my_dv_table[i].dest == dest) && (my_dv_table[i].netmask == netmask) && (my_dv_table[i].next_hop == next_hop)){
 				//fprintf(stderr, "\t\t%s with next hop ", fn_ntoa(dest)); 
 				//fprintf(stderr, "%s is already in dv table!\n", fn_ntoa(next_hop));
 				if(metric != my_dv_table[i].metric){
@@ -268,11 +687,11 @@ int in_dv_table(fnaddr_t dest, fnaddr_t next_hop, int metric){
 					present = DV_PRESENT;
 				}
 				//either case we need to update ttl
-				my_dv_table[i].ttl = 180;
+				my_dv_table[i].ttl = dv_route_ttl();
 				return present;
 			}
 			//check if dest is already there--> add a backup route
-			else if(my_dv_table[i].dest == dest){
+			else if((my_dv_table[i].dest == dest) && (my_dv_table[i].netmask == netmask)){
 				//fprintf(stderr, "%s already in dv table, ", fn_ntoa(dest));
 				//fprintf(stderr, "need to add backup route with next hop: %s\n", fn_ntoa(next_hop));
 				present = DV_BACKUP;
@@ -303,6 +722,8 @@ void add_to_dv_table(fnaddr_t dest, fnaddr_t next_hop, int metric, fnaddr_t netm
 	my_dv_table[i].dest     = dest;
 	my_dv_table[i].netmask  = netmask;
 	my_dv_table[i].next_hop = next_hop;
+	link_dv_next_hop(i);
+	link_dv_dest(i);
 	if(metric >= MAX_TTL){
 		my_dv_table[i].metric = MAX_TTL - 1;
 	}
@@ -310,15 +731,16 @@ void add_to_dv_table(fnaddr_t dest, fnaddr_t next_hop, int metric, fnaddr_t netm
 		my_dv_table[i].metric = metric + 1;
 	}
 	my_dv_table[i].metric   = metric + 1;
-        my_dv_table[i].ttl      = 180;	
+        my_dv_table[i].ttl      = dv_route_ttl();	
 
 	num_dv_stored += 1;
+	dv_entry_changed(&my_dv_table[i]);
 
 	//check to see if destination is already in the forwarding table
-	if(!in_forwarding_table(dest)){
+	if(!in_forwarding_table(dest, find_prefix_length(netmask))){
 		//fprintf(stderr, "%s is not in forwarding table, ", fn_ntoa(dest)); 
 		//fprintf(stderr, "adding with next hop: %s!\n", fn_ntoa(next_hop));	
-		my_dv_table[i].fwd_table_ptr = fish_fwd.add_fwtable_entry(dest, find_prefix_length(netmask), next_hop, metric, 'D', 0);
+		my_dv_table[i].fwd_table_ptr = dv_fwd_add(&my_dv_table[i]);
 		my_dv_table[i].in_forwarding_table = 1;
 	}
 	else{
@@ -347,8 +769,9 @@ void decrement_dv_table(){
 				}
 				
 				my_dv_table[i].state  = 'W';
-				my_dv_table[i].ttl    = 180;
+				my_dv_table[i].ttl    = dv_route_ttl();
 				my_dv_table[i].metric = MAX_TTL;
+				dv_entry_changed(&my_dv_table[i]);
 			
 			}
 			//if withdrawn
@@ -356,10 +779,14 @@ void decrement_dv_table(){
 				//shouldn't be in the forwarding table, just mark as invalid
 				//should stop advertising this thing
 				//fprintf(stderr, "Removing %s from dv table!!\n", fn_ntoa(my_dv_table[i].dest));
+				unlink_dv_next_hop(i);
+				unlink_dv_dest(i);
 				my_dv_table[i].valid = 0;
+				dv_entry_changed(&my_dv_table[i]);
 			}
 		}
 	}
+	age_rib_in();
 	//schedule for a second in the future
 	fish_scheduleevent(1000, decrement_dv_table, 0);
 }
@@ -370,6 +797,7 @@ void process_dv_packet(void *dv_frame, fnaddr_t dv_packet_source, int len){
 	
 	int dv_process = 0;
 	struct dv_packet *dv = (struct dv_packet *)dv_frame;
+	int num_adv = ntohs(dv->num_adv);
 	//fprintf(stderr, "\nDV PACKET\n"
 	//		"\tPacket Source is: %s\n"
 	//		"\tNumber of adv in this packet: %d\n", fn_ntoa(dv_packet_source), ntohs(dv->num_adv));
@@ -380,13 +808,25 @@ void process_dv_packet(void *dv_frame, fnaddr_t dv_packet_source, int len){
 	/* go through each advertisement and check the dv table to see if they already exist 
 	 * ----> will handle all management of forwarding table
 	 */
-	if(ntohs(dv->num_adv) == 0){
+	if(num_adv == 0){
 		if(!in_neighbor_table(dv_packet_source)){
 			add_neighbor_to_table(dv_packet_source);
 		}
+		return;
+	}
+	//never trust num_adv past the end of the frame
+	if(num_adv > (len - BLANK_DV_ADV) / (int)sizeof(struct dv_adv)){
+		num_adv = (len - BLANK_DV_ADV) / (int)sizeof(struct dv_adv);
+	}
+	if(!my_dv_batch.running){
+		rib_store_advertisements(dv_packet_source, &dv->adv_packets, num_adv);
+	}
+	if(dv_batch && !my_dv_batch.running){
+		queue_dv_packet(dv_frame, dv_packet_source, len);
+		return;
 	}
 	
-	while(i < ntohs(dv->num_adv)){
+	while(i < num_adv){
 		/* calc the netmask */
 		/* check out the metric */
 		/*
@@ -402,7 +842,7 @@ void process_dv_packet(void *dv_frame, fnaddr_t dv_packet_source, int len){
 		//fprintf(stderr, "\t\tConnection type: %c\n"
 		//		"\t\tPrefix Length  : %d\n",
 		//		connection_type, prefix_length);
-		dv_process = in_dv_table(advertisement->dest, dv_packet_source, ntohl(advertisement->metric));
+		dv_process = in_dv_table(advertisement->dest, advertisement->netmask, dv_packet_source, ntohl(advertisement->metric));
 		
 		if((dv_process == 0) && (ntohl(advertisement->metric) == MAX_TTL)){
 			//not in the table and the node is unreachable... ignore
@@ -428,377 +868,2689 @@ void process_dv_packet(void *dv_frame, fnaddr_t dv_packet_source, int len){
 	}
 }
 
-void send_blank_dv_advertisement(){
-	void *l4frame = malloc(sizeof(struct dv_packet) + L2_HEADER_LENGTH + L3_HEADER_LENGTH);
-	if(l4frame == NULL){
-		//fprintf(stderr, "Unable to malloc for empty dv advertisement, Exiting... \n");
-		exit(445);
+/* ========================================================= */
+/* ================= Batched DV Processing ================= */
+/* ========================================================= */
+void queue_dv_packet(void *dv_frame, fnaddr_t dv_packet_source, int len){
+	if(my_dv_batch.num_queued >= my_dv_batch.queue_size){
+		my_dv_batch.queue_size = (my_dv_batch.queue_size == 0) ? 16 : my_dv_batch.queue_size * 2;
+		my_dv_batch.queue = realloc(my_dv_batch.queue, my_dv_batch.queue_size * sizeof(struct dv_queued));
+		if(my_dv_batch.queue == NULL){
+			exit(4002);
+		}
 	}
-	l4frame += L2_HEADER_LENGTH + L3_HEADER_LENGTH;
+	//the frame belongs to libfish, hold on to it until the tick
+	struct dv_queued *queued = &my_dv_batch.queue[my_dv_batch.num_queued];
+	queued->dv_frame = frame_hold(dv_frame, len);
+	if(queued->dv_frame == NULL){
+		process_dv_packet(dv_frame, dv_packet_source, len); //too big to hold, apply it now
+		return;
+	}
+	queued->source = dv_packet_source;
+	queued->len    = len;
+	my_dv_batch.num_queued++;
+	my_dv_batch.packets_queued++;
 	
-	struct dv_packet *blank = l4frame;
-	blank->num_adv = 0;
-
-	//send the blank advertisement to all neighbors with a TTL of 1
-	fish_l3.fish_l3_send(blank, BLANK_DV_ADV, ALL_NEIGHBORS, L3_PROTO_DV, 1);
-}
-
-void advertise_dv(){
-	//fprintf(stderr, "\nBROADCASTING WITH 0 ADVERTISEMENTS!\n");
-	send_blank_dv_advertisement();
-	fish_scheduleevent(24000, advertise_dv, 0);
+	if(!my_dv_batch.scheduled){
+		my_dv_batch.scheduled = 1;
+		fish_scheduleevent(dv_batch_tick, run_dv_batch, 0);
+	}
 }
 
-int find_num_adv(){
-	int ret = 0;
-	int i = 0;
-	for(; i < my_dv_table_size; i++){
-		//only send valid active or backup routes
-		if(my_dv_table[i].valid && my_dv_table[i].state == 'A'){
-			ret += 1;
+/* the best usable route to dest record d, or -1 */
+int dv_batch_winner(int d){
+	int i = 0, winner = -1;
+	for(i = my_dv_dests.dests[d].head; i >= 0; i = my_dv_table[i].dest_next){
+		if((my_dv_table[i].state == 'W') || (my_dv_table[i].metric >= MAX_TTL)){
+			continue;
+		}
+		if((winner < 0) || (my_dv_table[i].metric < my_dv_table[winner].metric)){
+			winner = i;
+		}
+		else if(my_dv_table[i].metric == my_dv_table[winner].metric){
+			//keep the current active route on a tie so we don't flap, then the lowest index
+			if(((my_dv_table[i].state == 'A') && (my_dv_table[winner].state != 'A')) ||
+			   (((my_dv_table[i].state == 'A') == (my_dv_table[winner].state == 'A')) && (i < winner))){
+				winner = i;
+			}
 		}
-
-	}
-	if(ret >= MAX_ADV_IN_PACKET){
-		ret = MAX_ADV_IN_PACKET;
 	}
-	return ret;
+	return winner;
 }
 
-/* neighbor is needed for the split horizon implementation */
-void send_full_dv_advertisement(fnaddr_t neighbor){
-	//check to see how many advertisements we are making
-	int num_adv_sending = find_num_adv();
-	//fprintf(stderr, "\n\n"
-	//		"======================================\n"
-	//		"SENDING %d advertisements to %s\n"
-	//		"======================================\n\n",
-	//		num_adv_sending, fn_ntoa(neighbor));
-	//malloc for our dv packet
-	void *l4frame = malloc((sizeof(struct dv_adv) * num_adv_sending) + L2_HEADER_LENGTH + L3_HEADER_LENGTH);
-	l4frame += L2_HEADER_LENGTH + L3_HEADER_LENGTH; //move the frame along, thanks a lot!
-        
-	struct dv_packet *neigh_adv = (struct dv_packet *)l4frame;
-	struct dv_adv *fill_this = &neigh_adv->adv_packets;
-	if(neigh_adv == NULL){
-		//fprintf(stderr, "TRYING TO SEND A DV UPDATE AND IT FAILED :( Exiting....\n");
-		exit(2342234);
+/* makes the forwarding table hold exactly the winning route for every
+ * destination the batch touched, with as few writes as possible. A touched
+ * destination is found through its dest record, so the tick costs one pass
+ * over the forwarding table plus the entries of the touched destinations
+ */
+void dv_batch_reconcile(){
+	struct dv_touched *touched = NULL;
+	struct dv_entry *winner = NULL;
+	int i = 0, t = 0, d = 0;
+	
+	for(t = 0; t < my_dv_batch.num_touched; t++){
+		my_dv_batch.touched[t].winner = dv_batch_winner(my_dv_batch.touched[t].d);
+		my_dv_batch.touched[t].kept   = NULL;
 	}
-	neigh_adv->num_adv = ntohs(num_adv_sending);	
 	
- 	int i = 0;
-	int adv_added = 0;
-	for(; i < my_dv_table_size; i++){
-		//only send valid active or backup routes
-		if(my_dv_table[i].valid && my_dv_table[i].state == 'A'){
-			//add this to the dv packet that we malloced!!!!
-			fill_this->dest = my_dv_table[i].dest;
-			if(my_dv_table[i].next_hop == neighbor){
-				//advertise as unreachable since learned from this interface
-				//fprintf(stderr, "Sending to neighbor %s, need to mark this as MAX_TTL!!!\n", fn_ntoa(neighbor));
-				
-				fill_this->metric = htonl(MAX_TTL);
+	//one pass over the forwarding table: keep the entry that already matches, drop the rest
+	for(i = 0; (i < my_forwarding_table_size) && (my_dv_batch.num_touched > 0); i++){
+		if(!my_forwarding_table[i].valid || (my_forwarding_table[i].type != 'D')){
+			continue;
+		}
+		d = find_dv_dest(my_forwarding_table[i].dest, htonl(prefix_length_to_mask(my_forwarding_table[i].prefix_length)));
+		if((d < 0) || (my_dv_dests.dests[d].touched < 0)){
+			continue; //not ours to look at
+		}
+		touched = &my_dv_batch.touched[my_dv_dests.dests[d].touched];
+		winner = (touched->winner >= 0) ? &my_dv_table[touched->winner] : NULL;
+		if((winner != NULL) && (touched->kept == NULL) && (my_forwarding_table[i].next_hop == winner->next_hop)){
+			touched->kept = &my_forwarding_table[i];
+			if(my_forwarding_table[i].metric != winner->metric){
+				fish_fwd.update_fwtable_metric(touched->kept, winner->metric);
+				my_dv_batch.fwd_writes++;
 			}
-			else{
-				fill_this->metric = htonl(my_dv_table[i].metric);
+		}
+		else{
+			fish_fwd.remove_fwtable_entry(&my_forwarding_table[i]);
+			my_dv_batch.fwd_writes++;
+		}
+	}
+	
+	for(t = 0; t < my_dv_batch.num_touched; t++){
+		touched = &my_dv_batch.touched[t];
+		if((touched->winner >= 0) && (touched->kept == NULL)){
+			touched->kept = fish_fwd.add_fwtable_entry(touched->dest, 
+								   find_prefix_length(touched->netmask), 
+								   my_dv_table[touched->winner].next_hop, 
+								   my_dv_table[touched->winner].metric - 1, 
+								   'D', 
+								   0);
+			my_dv_batch.fwd_writes++;
+		}
+	}
+	
+	//finally line the dv states up with what is in the forwarding table
+	for(t = 0; t < my_dv_batch.num_touched; t++){
+		touched = &my_dv_batch.touched[t];
+		for(i = my_dv_dests.dests[touched->d].head; i >= 0; i = my_dv_table[i].dest_next){
+			if(i == touched->winner){
+				my_dv_table[i].in_forwarding_table = 1;
+				my_dv_table[i].fwd_table_ptr = touched->kept;
+				if(my_dv_table[i].state != 'A'){
+					my_dv_table[i].state = 'A';
+					dv_entry_changed(&my_dv_table[i]);
+				}
 			}
-			fill_this->netmask = my_dv_table[i].netmask;
-			
-			//fprintf(stderr, "\n"
-			//		"\tHERES ADVERTISEMENT %d:\n"
-			//		"\t\tDest  : %s\n"
-			//		"\t\tMetric: %d\n",
-			//		adv_added,
-			//		fn_ntoa(fill_this->dest),
-			//		ntohl(fill_this->metric));
-			//fprintf(stderr, "\t\tLearned this from: %s\n\n", fn_ntoa(my_dv_table[i].next_hop));
-
-			adv_added++;
-			fill_this++;
-			//if we already added all of our advertisements we can stop
-			if(adv_added >=  num_adv_sending){
-				break;
+			else{
+				my_dv_table[i].in_forwarding_table = 0;
+				my_dv_table[i].fwd_table_ptr = NULL;
+				if(my_dv_table[i].state == 'A'){
+					my_dv_table[i].state = 'B';
+					dv_entry_changed(&my_dv_table[i]);
+				}
 			}
 		}
-
 	}
-	//pass to lvl 3
-	if(num_adv_sending != 0){
-		fish_l3.fish_l3_send(neigh_adv, 2 + (num_adv_sending * sizeof(struct dv_adv)), neighbor, L3_PROTO_DV, 1);
-
+	for(t = 0; t < my_dv_batch.num_touched; t++){
+		dv_select_alternate(my_dv_batch.touched[t].dest, my_dv_batch.touched[t].netmask);
+		//done with it, a record whose last entry went during the batch goes now
+		d = my_dv_batch.touched[t].d;
+		my_dv_dests.dests[d].touched = -1;
+		if(my_dv_dests.dests[d].count == 0){
+			free_dv_dest(d);
+		}
 	}
+	my_dv_batch.num_touched = 0;
 }
 
-void send_non_poison_adv(){
-	int num_adv_sending = find_num_adv();
-	//fprintf(stderr, "\n\n"
-	//		"======================================\n"
-	//		"SENDING %d advertisements to %s\n"
-	//		"======================================\n\n",
-	//		num_adv_sending, fn_ntoa(neighbor));
-	//malloc for our dv packet
-	void *l4frame = malloc((sizeof(struct dv_adv) * num_adv_sending) + L2_HEADER_LENGTH + L3_HEADER_LENGTH);
-	l4frame += L2_HEADER_LENGTH + L3_HEADER_LENGTH; //move the frame along, thanks a lot!
-        
-	struct dv_packet *neigh_adv = (struct dv_packet *)l4frame;
-	struct dv_adv *fill_this = &neigh_adv->adv_packets;
-	if(neigh_adv == NULL){
-		//fprintf(stderr, "TRYING TO SEND A DV UPDATE AND IT FAILED :( Exiting....\n");
-		exit(2342234);
-	}
-	neigh_adv->num_adv = ntohs(num_adv_sending);	
-	
- 	int i = 0;
-	int adv_added = 0;
-	for(; i < my_dv_table_size; i++){
-		//only send valid active or backup routes
-		if(my_dv_table[i].valid){
-			fill_this->dest = my_dv_table[i].dest;
-			fill_this->metric = htonl(my_dv_table[i].metric);
-			fill_this->netmask = my_dv_table[i].netmask;
-			
-			adv_added++;
-			fill_this++;
-			if(adv_added >=  num_adv_sending){
-				break;
-			}
-		}
+/* forwarding table writes made between these two calls are coalesced */
+void dv_begin_deferred(){
+	my_dv_batch.running = 1;
+}
 
-	}
-	//pass to lvl 3
-	if(num_adv_sending != 0){
-		fish_l3.fish_l3_send(neigh_adv, 2 + (num_adv_sending * sizeof(struct dv_adv)), ALL_NEIGHBORS, L3_PROTO_DV, 1);
+void dv_end_deferred(){
+	dv_batch_reconcile();
+	my_dv_batch.running = 0;
+}
 
+/* applies everything that arrived during the last tick in one go */
+void run_dv_batch(){
+	int i = 0;
+	my_dv_batch.scheduled = 0;
+	dv_begin_deferred();
+	for(; i < my_dv_batch.num_queued; i++){
+		process_dv_packet(my_dv_batch.queue[i].dv_frame, my_dv_batch.queue[i].source, my_dv_batch.queue[i].len);
+		frame_release(my_dv_batch.queue[i].dv_frame);
 	}
-}
-/* advertise to our neighbor our routing table on triggered update*/
-void advertise_full_dv(){
-	//int i = 0;
-	//for(; i < my_neighbor_table_size; i++){
-		//if(my_neighbor_table[i].valid){
-			//fprintf(stderr, "Sending dv advertisement to neighbor %s\n", fn_ntoa(my_neighbor_table[i].neigh));
-		//	send_full_dv_advertisement(my_neighbor_table[i].neigh);
-		//}
-	//}
-	send_non_poison_adv();
-	fish_scheduleevent(19000, advertise_full_dv, 0);//schedule to send again in 30 seconds!
+	my_dv_batch.num_queued = 0;
+	dv_end_deferred();
+	my_dv_batch.batches_run++;
 }
 
 /* ========================================================= */
-/* ================ Neighbor Implementation ================ */
+/* ============= Adj-RIB-In (per neighbor routes) ========== */
 /* ========================================================= */
-void print_my_neighbor_table(){
-       	fprintf(stdout,"\n" 
-		"           NEIGHBOR TABLE         \n"
-		" =================================\n"
-		"     Neighbor           TTL       \n"
-		" ----------------      -----      \n");
-
-       int i = 0;
-       for(; i < my_neighbor_table_size; i++){
-       		if(my_neighbor_table[i].valid){
-			fprintf(stdout, "%17s       %4d\n", fn_ntoa(my_neighbor_table[i].neigh), my_neighbor_table[i].ttl);
+/* every neighbor's latest advertisement for each destination, sorted by
+ * destination so a refresh is a binary search. Lets us rebuild routes the
+ * moment something changes instead of waiting for the next advertisement
+ */
+struct adj_rib_in *find_rib_in(fnaddr_t neighbor){
+	int i = 0;
+	for(; i < my_rib_in_size; i++){
+		if(my_rib_in[i].valid && (my_rib_in[i].neighbor == neighbor)){
+			return &my_rib_in[i];
 		}
-       }
+	}
+	return NULL;
 }
 
-
-
-void decrement_neighbor_table(){
-	//decrement the ttl on every valid neighbor!
+struct adj_rib_in *add_rib_in(fnaddr_t neighbor){
 	int i = 0;
-	for(; i < num_neighbors_stored; i++){
-		if(my_neighbor_table[i].valid){
-			my_neighbor_table[i].ttl -= 1;
-			if(my_neighbor_table[i].ttl == 0){
-				//mark as invalid!
-				my_neighbor_table[i].valid = 0;
-			}
+	for(; i < my_rib_in_size; i++){
+		if(!my_rib_in[i].valid){
+			break;
 		}
 	}
-	//schedule this to happen again in 1 second!
-	fish_scheduleevent(1000, decrement_neighbor_table, 0);
+	if(i == my_rib_in_size){
+		my_rib_in_size = (my_rib_in_size == 0) ? 16 : my_rib_in_size * 2;
+		my_rib_in = realloc(my_rib_in, my_rib_in_size * sizeof(struct adj_rib_in));
+		if(my_rib_in == NULL){
+			exit(4101);
+		}
+		memset(&my_rib_in[i], 0, (my_rib_in_size - i) * sizeof(struct adj_rib_in));
+	}
+	my_rib_in[i].valid      = 1;
+	my_rib_in[i].neighbor   = neighbor;
+	my_rib_in[i].num_routes = 0;
+	return &my_rib_in[i];
 }
 
-/* resize table... checking is handled by function add_neighbor_to_table */
-void resize_neighbor_table(){
-	my_neighbor_table_size *= 2;
-
-	my_neighbor_table = realloc(my_neighbor_table, my_neighbor_table_size * sizeof(struct neighbor_entry)); 
-	if(my_neighbor_table == NULL){
-		//fprintf(stderr, "Unable to double the size of the neighbor table to %d! Exiting...\n", my_neighbor_table_size);
-		exit(1234);
+int compare_rib_key(fnaddr_t dest, fnaddr_t netmask, struct rib_route *route){
+	if(dest != route->dest){
+		return (dest < route->dest) ? -1 : 1;
+	}
+	if(netmask != route->netmask){
+		return (netmask < route->netmask) ? -1 : 1;
 	}
+	return 0;
+}
 
+/* returns the index of the route, or where it would be inserted */
+int find_rib_route(struct adj_rib_in *rib, fnaddr_t dest, fnaddr_t netmask, int *found){
+	int low = 0, high = rib->num_routes - 1, middle = 0, cmp = 0;
+	*found = 0;
+	while(low <= high){
+		middle = (low + high) / 2;
+		cmp = compare_rib_key(dest, netmask, &rib->routes[middle]);
+		if(cmp == 0){
+			*found = 1;
+			return middle;
+		}
+		if(cmp < 0){
+			high = middle - 1;
+		}
+		else{
+			low = middle + 1;
+		}
+	}
+	return low;
 }
 
-void add_neighbor_to_table(fnaddr_t neigh){
-	if(num_neighbors_stored >= my_neighbor_table_size){
-		resize_neighbor_table();
+void rib_store_advertisements(fnaddr_t neighbor, struct dv_adv *advertisement, int num_adv){
+	struct adj_rib_in *rib = find_rib_in(neighbor);
+	int i = 0, index = 0, found = 0;
+	uint32_t metric = 0;
+	if(rib == NULL){
+		rib = add_rib_in(neighbor);
 	}
-	int i = 0;
-	while(my_neighbor_table[i].valid){
-		if(my_neighbor_table[i].neigh == neigh){
-			my_neighbor_table[i].ttl = 120;
-			in_dv_table(neigh, neigh, 0);
-			return;
+	for(; i < num_adv; i++, advertisement++){
+		if(advertisement->dest == fish_getaddress()){
+			continue; //we know how to get to ourselves
 		}
-		i++;
+		metric = ntohl(advertisement->metric);
+		if(metric > MAX_TTL){
+			metric = MAX_TTL;
+		}
+		index = find_rib_route(rib, advertisement->dest, advertisement->netmask, &found);
+		if(!found){
+			if(metric == MAX_TTL){
+				continue; //nothing to withdraw
+			}
+			if(rib->num_routes >= rib->size){
+				rib->size = (rib->size == 0) ? 32 : rib->size * 2;
+				rib->routes = realloc(rib->routes, rib->size * sizeof(struct rib_route));
+				if(rib->routes == NULL){
+					exit(4102);
+				}
+			}
+			memmove(&rib->routes[index + 1], &rib->routes[index], (rib->num_routes - index) * sizeof(struct rib_route));
+			rib->routes[index].dest    = advertisement->dest;
+			rib->routes[index].netmask = advertisement->netmask;
+			rib->num_routes++;
+		}
+		rib->routes[index].metric = metric;
+		rib->routes[index].ttl    = dv_route_ttl();
 	}
+}
+
+/* once a second: routes a neighbor stopped advertising fall out */
+void age_rib_in(){
+	int i = 0, j = 0, kept = 0;
+	for(; i < my_rib_in_size; i++){
+		if(!my_rib_in[i].valid){
+			continue;
+		}
+		for(j = 0, kept = 0; j < my_rib_in[i].num_routes; j++){
+			if(--my_rib_in[i].routes[j].ttl > 0){
+				my_rib_in[i].routes[kept++] = my_rib_in[i].routes[j];
+			}
+		}
+		my_rib_in[i].num_routes = kept;
+	}
+}
+
+int find_dv_entry(fnaddr_t dest, fnaddr_t netmask, fnaddr_t next_hop){
+	int i = 0;
+	for(; i < my_dv_table_size; i++){
+		if(my_dv_table[i].valid && (my_dv_table[i].dest == dest) && 
+		   (my_dv_table[i].netmask == netmask) && (my_dv_table[i].next_hop == next_hop)){
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* makes the dv entry for this neighbor's route agree with its rib, must be deferred */
+void rib_apply_route(fnaddr_t neighbor, struct rib_route *route){
+	int index = find_dv_entry(route->dest, route->netmask, neighbor);
+	struct dv_entry *entry = NULL;
+	if(index < 0){
+		if(route->metric < MAX_TTL){
+			add_to_dv_table(route->dest, neighbor, route->metric, route->netmask, 'B');
+		}
+		return;
+	}
+	entry = &my_dv_table[index];
+	entry->ttl = route->ttl;
+	if(route->metric >= MAX_TTL){
+		if(entry->state != 'W'){
+			entry->state  = 'W';
+			entry->metric = MAX_TTL;
+			dv_batch_touch(entry);
+			dv_entry_changed(entry);
+		}
+	}
+	else if((entry->state == 'W') || (entry->metric != (int)route->metric + 1)){
+		if(entry->state == 'W'){
+			entry->state = 'B'; //reconcile decides if it becomes active
+		}
+		entry->metric = route->metric + 1;
+		dv_batch_touch(entry);
+		dv_entry_changed(entry);
+	}
+}
+
+/* rebuilds one destination from every live neighbor's rib, must be deferred */
+void rib_recompute(fnaddr_t dest, fnaddr_t netmask){
+	int i = 0, index = 0, found = 0;
+	for(; i < my_rib_in_size; i++){
+		if(!my_rib_in[i].valid){
+			continue;
+		}
+		index = find_rib_route(&my_rib_in[i], dest, netmask, &found);
+		if(found){
+			rib_apply_route(my_rib_in[i].neighbor, &my_rib_in[i].routes[index]);
+		}
+	}
+}
+
+/* replays every stored route, e.g. after the dv state was thrown off */
+void rib_recompute_all(){
+	int i = 0, j = 0;
+	dv_begin_deferred();
+	for(; i < my_rib_in_size; i++){
+		if(!my_rib_in[i].valid){
+			continue;
+		}
+		for(j = 0; j < my_rib_in[i].num_routes; j++){
+			rib_apply_route(my_rib_in[i].neighbor, &my_rib_in[i].routes[j]);
+		}
+	}
+	dv_end_deferred();
+}
+
+/* forgets everything the neighbor told us and immediately falls back to
+ * whatever the other neighbors are advertising for those destinations. Only
+ * the neighbor's own routes are visited, and everything that changed goes
+ * out to the other neighbors in one triggered update
+ */
+void rib_neighbor_down(fnaddr_t neighbor){
+	struct adj_rib_in *rib = find_rib_in(neighbor);
+	struct next_hop_index *hop = find_next_hop(&my_dv_hops, neighbor, 0);
+	struct adv_candidate *cands = NULL;
+	struct dv_touched *changed = NULL;
+	int i = 0, next = 0, num_changed = 0, num_cands = 0, j = 0, d = 0;
+	if(rib != NULL){
+		rib->valid = 0;
+		rib->num_routes = 0;
+	}
+	if(hop == NULL){
+		return;
+	}
+	dv_begin_deferred();
+	for(i = hop->head; i >= 0; i = next){
+		next = my_dv_table[i].hop_next;
+		if(my_dv_table[i].state == 'W'){
+			continue;
+		}
+		my_dv_table[i].state  = 'W';
+		my_dv_table[i].metric = MAX_TTL;
+		my_dv_table[i].ttl    = dv_route_ttl();
+		dv_batch_touch(&my_dv_table[i]);
+		dv_entry_changed(&my_dv_table[i]);
+		rib_recompute(my_dv_table[i].dest, my_dv_table[i].netmask);
+	}
+	//reconcile empties the touched list, keep what needs advertising
+	num_changed = my_dv_batch.num_touched;
+	changed = malloc((num_changed + 1) * sizeof(struct dv_touched));
+	cands   = malloc((num_changed + 1) * sizeof(struct adv_candidate));
+	if((changed == NULL) || (cands == NULL)){
+		exit(4301);
+	}
+	memcpy(changed, my_dv_batch.touched, num_changed * sizeof(struct dv_touched));
+	dv_end_deferred();
+
+	//one record per destination, whichever of its entries speaks for it
+	for(j = 0; j < num_changed; j++){
+		d = find_dv_dest(changed[j].dest, changed[j].netmask);
+		for(i = (d >= 0) ? my_dv_dests.dests[d].head : -1; i >= 0; i = my_dv_table[i].dest_next){
+			if(is_advertised(i)){
+				fill_adv_candidate(&cands[num_cands++], i, ALL_NEIGHBORS);
+				break;
+			}
+		}
+	}
+	if(num_cands){
+		send_adv_candidates(cands, num_cands, ALL_NEIGHBORS);
+		dv_triggered_updates++;
+	}
+	free(changed);
+	free(cands);
+}
+
+/* ========================================================= */
+/* ================= Loop-Free Alternates ================== */
+/* ========================================================= */
+/* picks the backup the data path falls back on when the active next hop dies.
+ * A neighbor is only safe if its own distance is below ours (the DUAL
+ * feasibility condition), otherwise it may be routing through us
+ */
+void dv_select_alternate(fnaddr_t dest, fnaddr_t netmask){
+	struct dv_entry *active = NULL, *alternate = NULL;
+	struct forwarding_table_entry *fwd = NULL;
+	int i = 0;
+	int d = find_dv_dest(dest, netmask), first = -1;
+	if(my_dv_batch.running || (d < 0)){
+		return; //reconcile comes back for it, or there is nothing left
+	}
+	first = my_dv_dests.dests[d].head;
+	//the lowest index wins, same as the scan over the whole table used to
+	for(i = first; i >= 0; i = my_dv_table[i].dest_next){
+		if((my_dv_table[i].state == 'A') && my_dv_table[i].in_forwarding_table &&
+		   ((active == NULL) || (&my_dv_table[i] < active))){
+			active = &my_dv_table[i];
+		}
+	}
+	if((active == NULL) || (active->fwd_table_ptr == NULL)){
+		return;
+	}
+	for(i = first; i >= 0; i = my_dv_table[i].dest_next){
+		if((my_dv_table[i].state == 'W') || (my_dv_table[i].metric >= MAX_TTL) || (my_dv_table[i].next_hop == active->next_hop)){
+			continue;
+		}
+		//reported distance is what the neighbor advertised, one less than we store
+		if((my_dv_table[i].metric - 1 < active->metric) && 
+		   ((alternate == NULL) || (my_dv_table[i].metric < alternate->metric) ||
+		    ((my_dv_table[i].metric == alternate->metric) && (&my_dv_table[i] < alternate)))){
+			alternate = &my_dv_table[i]; //ties to the lowest index, whatever the chain order
+		}
+	}
+	fwd = active->fwd_table_ptr;
+	if(alternate == NULL){
+		fwd->alt_next_hop = 0;
+		fwd->alt_metric   = 0;
+	}
+	else{
+		fwd->alt_next_hop = alternate->next_hop;
+		fwd->alt_metric   = alternate->metric;
+	}
+}
+
+void print_my_rib_in(){
+	int i = 0, j = 0;
+	fprintf(stdout, "\n"
+		"                 ADJ-RIB-IN (RECEIVED ROUTES)              \n"
+		" ========================================================= \n"
+		"     Neighbor           Destination          Metric   TTL  \n"
+		" ----------------   --------------------   ------   ---    \n");
+	for(; i < my_rib_in_size; i++){
+		if(!my_rib_in[i].valid){
+			continue;
+		}
+		for(j = 0; j < my_rib_in[i].num_routes; j++){
+			fprintf(stdout, "%17s", fn_ntoa(my_rib_in[i].neighbor));
+			fprintf(stdout, "%20s/%-2d", fn_ntoa(my_rib_in[i].routes[j].dest), __builtin_popcount(my_rib_in[i].routes[j].netmask));
+			fprintf(stdout, "   %6d  %4d\n", my_rib_in[i].routes[j].metric, my_rib_in[i].routes[j].ttl);
+		}
+	}
+}
+
+void send_blank_dv_advertisement(){
+	struct pkt_buf pkt;
+	//a blank advertisement is just the count, so fill it through a pointer of that size
+	uint16_t *num_adv = pkt_init(&pkt, BLANK_DV_ADV);
+	*num_adv = 0;
+
+	//send the blank advertisement to all neighbors with a TTL of 1
+	l3_send_pkt(&pkt, ALL_NEIGHBORS, L3_PROTO_DV, 1);
+	pkt_release(&pkt);
+}
+
+void advertise_dv(){
+	//fprintf(stderr, "\nBROADCASTING WITH 0 ADVERTISEMENTS!\n");
+	send_blank_dv_advertisement();
+	fish_scheduleevent(24000, advertise_dv, 0);
+}
+
+/* returns 1 if this dv entry speaks for its destination in our advertisements:
+ * the active route, or a withdrawal (sent at MAX_TTL) when nothing is active.
+ * only the first such entry per destination counts so receivers see one metric
+ */
+int is_advertised(int index){
+	struct dv_entry *entry = &my_dv_table[index];
+	int i = 0, d = 0;
+	if(!entry->valid || ((entry->state != 'A') && (entry->state != 'W'))){
+		return 0;
+	}
+	d = find_dv_dest(entry->dest, entry->netmask);
+	for(i = (d < 0) ? -1 : my_dv_dests.dests[d].head; i >= 0; i = my_dv_table[i].dest_next){
+		if(i == index){
+			continue;
+		}
+		//an active route always beats a withdrawal, otherwise first one wins
+		if((my_dv_table[i].state == 'A') && ((entry->state == 'W') || (i < index))){
+			return 0;
+		}
+		if((my_dv_table[i].state == 'W') && (entry->state == 'W') && (i < index)){
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* describes dv entry index as an advertisement, poisoning routes learned from neighbor */
+void fill_adv_candidate(struct adv_candidate *cand, int index, fnaddr_t neighbor){
+	struct dv_entry *entry = &my_dv_table[index];
+	cand->prefix_length = __builtin_popcount(entry->netmask);
+	cand->dest          = ntohl(entry->dest) & prefix_length_to_mask(cand->prefix_length);
+	cand->next_hop      = entry->next_hop;
+	cand->aggregate     = 0;
+	if((entry->state == 'W') || (entry->metric >= MAX_TTL) || (entry->next_hop == neighbor)){
+		//withdrawn, or split horizon with poison reverse
+		cand->metric = MAX_TTL;
+	}
+	else{
+		cand->metric = entry->metric;
+	}
+}
+
+/* fills cands with everything we advertise */
+int collect_adv_candidates(struct adv_candidate *cands, fnaddr_t neighbor){
+	int i = 0;
+	int num_cands = 0;
+	for(; i < my_dv_table_size; i++){
+		if(is_advertised(i)){
+			fill_adv_candidate(&cands[num_cands], i, neighbor);
+			num_cands++;
+		}
+	}
+	return num_cands;
+}
+
+/* sorts so that siblings (same length, next hop and metric) end up next to each other */
+int compare_adv_candidates(const void *first, const void *second){
+	const struct adv_candidate *a = first;
+	const struct adv_candidate *b = second;
+	if(a->prefix_length != b->prefix_length){
+		return b->prefix_length - a->prefix_length; //longest first
+	}
+	if(a->next_hop != b->next_hop){
+		return (a->next_hop < b->next_hop) ? -1 : 1;
+	}
+	if(a->metric != b->metric){
+		return a->metric - b->metric;
+	}
+	if(a->dest != b->dest){
+		return (a->dest < b->dest) ? -1 : 1;
+	}
+	return 0;
+}
+
+int adv_candidate_present(struct adv_candidate *cands, int num_cands, uint32_t dest, int prefix_length){
+	int i = 0;
+	for(; i < num_cands; i++){
+		if((cands[i].prefix_length == prefix_length) && (cands[i].dest == dest)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* collapses sibling prefixes with the same next hop and metric into their parent,
+ * repeating until nothing else merges. A merge never covers any address that
+ * the two siblings didn't already cover, and it is skipped if the parent prefix
+ * is already advertised, so longest prefix match downstream gives the same answer.
+ * returns the new number of candidates
+ */
+int aggregate_adv_candidates(struct adv_candidate *cands, int num_cands){
+	int merged = 1;
+	int i = 0, j = 0;
+	uint32_t bit = 0;
+	while(merged){
+		merged = 0;
+		qsort(cands, num_cands, sizeof(struct adv_candidate), compare_adv_candidates);
+		for(i = 0; i + 1 < num_cands; i++){
+			struct adv_candidate *low  = &cands[i];
+			struct adv_candidate *high = &cands[i + 1];
+			if((low->prefix_length <= 0) || (low->metric >= MAX_TTL)){
+				continue;
+			}
+			if((low->prefix_length != high->prefix_length) || 
+			   (low->next_hop != high->next_hop) || 
+			   (low->metric != high->metric)){
+				continue;
+			}
+			bit = (uint32_t)1 << (32 - low->prefix_length);
+			if((low->dest & bit) || (high->dest != (low->dest | bit))){
+				continue;
+			}
+			if(adv_candidate_present(cands, num_cands, low->dest, low->prefix_length - 1)){
+				continue;
+			}
+			low->prefix_length -= 1;
+			low->aggregate      = 1;
+			high->prefix_length = -1; //dropped below
+			merged = 1;
+			i++;
+		}
+		//squeeze out the siblings that were folded into their parent
+		for(i = 0, j = 0; i < num_cands; i++){
+			if(cands[i].prefix_length >= 0){
+				cands[j++] = cands[i];
+			}
+		}
+		num_cands = j;
+	}
+	return num_cands;
+}
+
+void serialize_adv_candidate(struct dv_adv *record, struct adv_candidate *cand){
+	record->dest    = htonl(cand->dest);
+	record->netmask = htonl(prefix_length_to_mask(cand->prefix_length));
+	record->metric  = htonl(cand->metric);
+}
+
+/* serializes the candidates into as many dv packets as it takes */
+void send_adv_candidates(struct adv_candidate *cands, int num_cands, fnaddr_t dst_addr){
+	int sent = 0, i = 0;
+	int num_adv_sending = 0;
+	struct pkt_buf pkt;
+	while(sent < num_cands){
+		num_adv_sending = num_cands - sent;
+		if(num_adv_sending > MAX_ADV_IN_PACKET){
+			num_adv_sending = MAX_ADV_IN_PACKET;
+		}
+		struct dv_packet *neigh_adv = pkt_init(&pkt, BLANK_DV_ADV + (sizeof(struct dv_adv) * num_adv_sending));
+		struct dv_adv *fill_this = &neigh_adv->adv_packets;
+		neigh_adv->num_adv = htons(num_adv_sending);
+		
+		for(i = 0; i < num_adv_sending; i++){
+			serialize_adv_candidate(fill_this, &cands[sent + i]);
+			fill_this++;
+		}
+		//pass to lvl 3
+		l3_send_pkt(&pkt, dst_addr, L3_PROTO_DV, 1);
+		pkt_release(&pkt);
+		sent += num_adv_sending;
+	}
+}
+
+/* neighbor is needed for the split horizon implementation, ALL_NEIGHBORS for a plain broadcast */
+void send_dv_advertisement(fnaddr_t neighbor){
+	struct adv_candidate *cands = malloc(sizeof(struct adv_candidate) * my_dv_table_size);
+	if(cands == NULL){
+		exit(2342235);
+	}
+	int num_cands = collect_adv_candidates(cands, neighbor);
+	if(dv_aggregate){
+		num_cands = aggregate_adv_candidates(cands, num_cands);
+	}
+	send_adv_candidates(cands, num_cands, neighbor);
+	free(cands);
+}
+
+void send_full_dv_advertisement(fnaddr_t neighbor){
+	send_dv_advertisement(neighbor);
+}
+
+/* ========================================================= */
+/* ============== Cached Broadcast Advertisement =========== */
+/* ========================================================= */
+
+struct dv_adv *adv_cache_records(){
+	return (struct dv_adv *)(my_adv_cache.frame + L2_HEADER_LENGTH + L3_HEADER_LENGTH + BLANK_DV_ADV);
+}
+
+void resize_adv_cache(){
+	int new_size = (my_adv_cache.size == 0) ? 128 : my_adv_cache.size * 2;
+	
+	my_adv_cache.cands = realloc(my_adv_cache.cands, new_size * sizeof(struct adv_candidate));
+	my_adv_cache.owner = realloc(my_adv_cache.owner, new_size * sizeof(int));
+	my_adv_cache.frame = realloc(my_adv_cache.frame, L2_HEADER_LENGTH + L3_HEADER_LENGTH + BLANK_DV_ADV + (new_size * sizeof(struct dv_adv)));
+	if((my_adv_cache.cands == NULL) || (my_adv_cache.owner == NULL) || (my_adv_cache.frame == NULL)){
+		exit(2342236);
+	}
+	my_adv_cache.size = new_size;
+}
+
+void mark_dv_dirty(int index){
+	if(my_dv_table[index].dirty){
+		return; //already waiting
+	}
+	if(my_adv_cache.num_dirty >= my_adv_cache.dirty_size){
+		my_adv_cache.dirty_size = (my_adv_cache.dirty_size == 0) ? 128 : my_adv_cache.dirty_size * 2;
+		my_adv_cache.dirty = realloc(my_adv_cache.dirty, my_adv_cache.dirty_size * sizeof(int));
+		if(my_adv_cache.dirty == NULL){
+			exit(2342237);
+		}
+	}
+	my_dv_table[index].dirty = 1;
+	my_adv_cache.dirty[my_adv_cache.num_dirty++] = index;
+}
+
+/* call whenever an entry's state, metric or validity changes. Which entry
+ * speaks for a destination depends on its siblings, so they get looked at
+ * too, straight off the destination's chain. Its alternate is picked again
+ * once per flush however many of its entries changed in the meantime
+ */
+void dv_entry_changed(struct dv_entry *entry){
+	int d = find_dv_dest(entry->dest, entry->netmask), i = 0;
+	mark_dv_dirty(entry - my_dv_table);
+	if(d < 0){
+		return; //that was the last entry, nothing left to speak for it
+	}
+	for(i = my_dv_dests.dests[d].head; i >= 0; i = my_dv_table[i].dest_next){
+		mark_dv_dirty(i);
+	}
+	if(my_dv_dests.dests[d].alt_pending){
+		return;
+	}
+	if(my_dv_dests.num_pending >= my_dv_dests.pending_size){
+		my_dv_dests.pending_size = (my_dv_dests.pending_size == 0) ? 64 : my_dv_dests.pending_size * 2;
+		my_dv_dests.pending = realloc(my_dv_dests.pending, my_dv_dests.pending_size * sizeof(int));
+		if(my_dv_dests.pending == NULL){
+			exit(2703);
+		}
+	}
+	my_dv_dests.dests[d].alt_pending = 1;
+	my_dv_dests.pending[my_dv_dests.num_pending++] = d;
+	if(!my_dv_dests.scheduled){
+		my_dv_dests.scheduled = 1;
+		fish_scheduleevent(0, dv_alternates_flush, 0);
+	}
+}
+
+/* picks the alternate once for every destination that changed since the last flush */
+void dv_alternates_flush(){
+	int i = 0, d = 0;
+	my_dv_dests.scheduled = 0;
+	for(; i < my_dv_dests.num_pending; i++){
+		d = my_dv_dests.pending[i];
+		if(!my_dv_dests.dests[d].alt_pending){
+			continue; //gone, or already done
+		}
+		my_dv_dests.dests[d].alt_pending = 0;
+		dv_select_alternate(my_dv_dests.dests[d].dest, my_dv_dests.dests[d].netmask);
+	}
+	my_dv_dests.num_pending = 0;
+}
+
+/* removes a slot by moving the last one into it */
+void drop_adv_slot(int slot, int in_place){
+	int last = --my_adv_cache.num_cands;
+	my_dv_table[my_adv_cache.owner[slot]].adv_slot = -1;
+	if(slot != last){
+		my_adv_cache.cands[slot] = my_adv_cache.cands[last];
+		my_adv_cache.owner[slot] = my_adv_cache.owner[last];
+		my_dv_table[my_adv_cache.owner[slot]].adv_slot = slot;
+		if(in_place){
+			adv_cache_records()[slot] = adv_cache_records()[last];
+		}
+	}
+}
+
+/* regenerates every wire record, summarizing them if dv_aggregate is on.
+ * Receivers only ever learned a summary under its own prefix, so one that
+ * was on the wire last time and isn't now (a member went away or moved, or
+ * dv_aggregate was turned off) is withdrawn explicitly at MAX_TTL. Otherwise
+ * the stale summary would keep pulling traffic towards us until it timed out.
+ * The withdrawals go at the end of the wire records and stay remembered, at
+ * MAX_TTL, until send_adv_cache has actually sent them
+ */
+void rebuild_adv_cache(){
+	struct adv_candidate *cands = NULL;
+	int num_cands = my_adv_cache.num_cands, num_withdrawn = 0;
+	int i = 0;
+	cands = malloc((num_cands + my_adv_cache.num_aggregates + 1) * sizeof(struct adv_candidate));
+	if(cands == NULL){
+		exit(2342238);
+	}
+	memcpy(cands, my_adv_cache.cands, num_cands * sizeof(struct adv_candidate));
+	if(dv_aggregate && (num_cands > 0)){
+		num_cands = aggregate_adv_candidates(cands, num_cands);
+	}
+	for(i = 0; i < my_adv_cache.num_aggregates; i++){
+		if(!adv_candidate_present(cands, num_cands, my_adv_cache.aggregates[i].dest, my_adv_cache.aggregates[i].prefix_length)){
+			cands[num_cands + num_withdrawn] = my_adv_cache.aggregates[i];
+			cands[num_cands + num_withdrawn].metric    = MAX_TTL;
+			cands[num_cands + num_withdrawn].aggregate = 1; //remembered until it is sent
+			num_withdrawn++;
+		}
+	}
+	
+	/* remember this round's summaries and withdrawals for the next one */
+	my_adv_cache.num_aggregates = 0;
+	for(i = 0; i < num_cands + num_withdrawn; i++){
+		if(!cands[i].aggregate){
+			continue;
+		}
+		if(my_adv_cache.num_aggregates >= my_adv_cache.aggregates_size){
+			my_adv_cache.aggregates_size = (my_adv_cache.aggregates_size == 0) ? 16 : my_adv_cache.aggregates_size * 2;
+			my_adv_cache.aggregates = realloc(my_adv_cache.aggregates, my_adv_cache.aggregates_size * sizeof(struct adv_candidate));
+			if(my_adv_cache.aggregates == NULL){
+				exit(2342240);
+			}
+		}
+		my_adv_cache.aggregates[my_adv_cache.num_aggregates++] = cands[i];
+	}
+	
+	num_cands += num_withdrawn;
+	while(num_cands > my_adv_cache.size){
+		resize_adv_cache();
+	}
+	for(i = 0; i < num_cands; i++){
+		serialize_adv_candidate(&adv_cache_records()[i], &cands[i]);
+	}
+	free(cands);
+	my_adv_cache.num_wire        = num_cands;
+	my_adv_cache.num_withdrawing = num_withdrawn;
+	my_adv_cache.aggregated      = dv_aggregate;
+	my_adv_cache.rebuild    = 0;
+}
+
+/* brings the cache up to date, only touching entries that went dirty */
+void refresh_adv_cache(){
+	int i = 0, index = 0, slot = 0;
+	dv_alternates_flush();
+	if(my_adv_cache.aggregated != dv_aggregate){
+		my_adv_cache.rebuild = 1;
+	}
+	//unsent withdrawals sit behind the routes, an in place update could overwrite them
+	if(my_adv_cache.num_withdrawing && my_adv_cache.num_dirty){
+		my_adv_cache.rebuild = 1;
+	}
+	//without summarization every slot maps 1:1 onto a wire record
+	int in_place = !my_adv_cache.rebuild && !dv_aggregate;
+	
+	for(; i < my_adv_cache.num_dirty; i++){
+		index = my_adv_cache.dirty[i];
+		my_dv_table[index].dirty = 0;
+		slot = my_dv_table[index].adv_slot;
+		if(is_advertised(index)){
+			if(slot < 0){
+				if(my_adv_cache.num_cands >= my_adv_cache.size){
+					resize_adv_cache();
+				}
+				slot = my_adv_cache.num_cands++;
+				my_adv_cache.owner[slot] = index;
+				my_dv_table[index].adv_slot = slot;
+			}
+			fill_adv_candidate(&my_adv_cache.cands[slot], index, ALL_NEIGHBORS);
+			if(in_place){
+				serialize_adv_candidate(&adv_cache_records()[slot], &my_adv_cache.cands[slot]);
+			}
+		}
+		else if(slot >= 0){
+			drop_adv_slot(slot, in_place);
+		}
+		if(dv_aggregate){
+			my_adv_cache.rebuild = 1; //a summary can change anywhere
+		}
+	}
+	my_adv_cache.num_dirty = 0;
+	
+	if(my_adv_cache.rebuild){
+		rebuild_adv_cache();
+	}
+	else if(!dv_aggregate && !my_adv_cache.num_withdrawing){
+		my_adv_cache.num_wire = my_adv_cache.num_cands;
+	}
+}
+
+/* the withdrawals at the end of the wire records went out, forget them */
+void adv_withdrawals_sent(){
+	int i = 0, j = 0;
+	if(!my_adv_cache.num_withdrawing){
+		return;
+	}
+	for(; i < my_adv_cache.num_aggregates; i++){
+		if(my_adv_cache.aggregates[i].metric != MAX_TTL){
+			my_adv_cache.aggregates[j++] = my_adv_cache.aggregates[i];
+		}
+	}
+	my_adv_cache.num_aggregates   = j;
+	my_adv_cache.num_wire        -= my_adv_cache.num_withdrawing;
+	my_adv_cache.num_withdrawing  = 0;
+}
+
+/* sends the cached records, the first packet straight out of the cache */
+void send_adv_cache(fnaddr_t dst_addr){
+	int sent = 0;
+	int num_adv_sending = 0;
+	struct dv_packet *neigh_adv = NULL;
+	struct pkt_buf pkt;
+	while(sent < my_adv_cache.num_wire){
+		num_adv_sending = my_adv_cache.num_wire - sent;
+		if(num_adv_sending > MAX_ADV_IN_PACKET){
+			num_adv_sending = MAX_ADV_IN_PACKET;
+		}
+		if(sent == 0){
+			neigh_adv = (struct dv_packet *)(my_adv_cache.frame + L2_HEADER_LENGTH + L3_HEADER_LENGTH);
+		}
+		else{
+			if(my_adv_cache.chunk == NULL){
+				my_adv_cache.chunk = malloc(L2_HEADER_LENGTH + L3_HEADER_LENGTH + BLANK_DV_ADV + (MAX_ADV_IN_PACKET * sizeof(struct dv_adv)));
+				if(my_adv_cache.chunk == NULL){
+					exit(2342239);
+				}
+			}
+			neigh_adv = (struct dv_packet *)(my_adv_cache.chunk + L2_HEADER_LENGTH + L3_HEADER_LENGTH);
+			memcpy(&neigh_adv->adv_packets, &adv_cache_records()[sent], num_adv_sending * sizeof(struct dv_adv));
+		}
+		neigh_adv->num_adv = htons(num_adv_sending);
+		//both frames keep their headroom, the l3 header goes right in front
+		pkt_wrap(&pkt, neigh_adv, BLANK_DV_ADV + (num_adv_sending * sizeof(struct dv_adv)));
+		l3_send_pkt(&pkt, dst_addr, L3_PROTO_DV, 1);
+		sent += num_adv_sending;
+	}
+}
+
+void send_non_poison_adv(){
+	refresh_adv_cache();
+	send_adv_cache(ALL_NEIGHBORS);
+	adv_withdrawals_sent();
+}
+/* advertise to our neighbor our routing table on triggered update*/
+void advertise_full_dv(){
+	//int i = 0;
+	//for(; i < my_neighbor_table_size; i++){
+		//if(my_neighbor_table[i].valid){
+			//fprintf(stderr, "Sending dv advertisement to neighbor %s\n", fn_ntoa(my_neighbor_table[i].neigh));
+		//	send_full_dv_advertisement(my_neighbor_table[i].neigh);
+		//}
+	//}
+	send_non_poison_adv();
+	fish_scheduleevent(dv_refresh * 1000, advertise_full_dv, 0);//schedule to send again in dv_refresh seconds!
+}
+
+/* ========================================================= */
+/* ================ Neighbor Implementation ================ */
+/* ========================================================= */
+void print_my_neighbor_table(){
+       	fprintf(stdout,"\n" 
+		"           NEIGHBOR TABLE                  \n"
+		" ==========================================\n"
+		"     Neighbor           TTL    Probe Every \n"
+		" ----------------      -----   ----------- \n");
+
+       int i = 0;
+       for(; i < my_neighbor_table_size; i++){
+       		if(my_neighbor_table[i].valid){
+			fprintf(stdout, "%17s       %4d   %10ds", fn_ntoa(my_neighbor_table[i].neigh), my_neighbor_table[i].ttl, my_neighbor_table[i].probe_interval);
+			if(my_neighbor_table[i].fast_live){
+				fprintf(stdout, "   fast %d ms", my_neighbor_table[i].fast_detect);
+			}
+			fprintf(stdout, "\n");
+		}
+       }
+       fprintf(stdout, "%d probes sent, %d refreshes from traffic\n", neigh_probes_sent, neigh_traffic_refreshes);
+       fprintf(stdout, "%d neighbor downs from libfish, %d triggered withdrawals sent\n", libfish_neighbor_downs, dv_triggered_updates);
+       if(fast_hello){
+		fprintf(stdout, "Fast hello every %d ms, down after %d missed, %d failures detected\n", 
+			fast_hello_interval, fast_hello_mult, fast_hello_failures);
+       }
+}
+
+int neighbor_bucket(fnaddr_t address){
+	return fnaddr_hash(address) & (my_neighbor_hash_size - 1);
+}
+
+/* returns the slot holding the neighbor, or -1 */
+int find_neighbor(fnaddr_t address){
+	int i = -1;
+	if(my_neighbor_hash_size == 0){
+		return -1; //table isn't up yet
+	}
+	for(i = my_neighbor_hash[neighbor_bucket(address)]; i >= 0; i = my_neighbor_table[i].hash_next){
+		if(my_neighbor_table[i].neigh == address){
+			break;
+		}
+	}
+	return i;
+}
+
+/* puts slots [first, last) on the free list, lowest slot first */
+void free_neighbor_slots(int first, int last){
+	int i = last - 1;
+	for(; i >= first; i--){
+		my_neighbor_table[i].valid     = 0;
+		my_neighbor_table[i].free_next = neighbor_free_list;
+		neighbor_free_list = i;
+	}
+}
+
+/* the buckets are sized off the table, so they get rebuilt along with it */
+void rehash_neighbor_table(){
+	int i = 0, bucket = 0;
+	free(my_neighbor_hash);
+	my_neighbor_hash_size = my_neighbor_table_size * 2;
+	my_neighbor_hash = malloc(my_neighbor_hash_size * sizeof(int));
+	if(my_neighbor_hash == NULL){
+		exit(1235);
+	}
+	memset(my_neighbor_hash, 0xFF, my_neighbor_hash_size * sizeof(int)); //all -1
+	for(; i < my_neighbor_table_size; i++){
+		if(my_neighbor_table[i].valid){
+			bucket = neighbor_bucket(my_neighbor_table[i].neigh);
+			my_neighbor_table[i].hash_next = my_neighbor_hash[bucket];
+			my_neighbor_hash[bucket] = i;
+		}
+	}
+}
+
+void init_neighbor_table(int size){
+	my_neighbor_table = calloc(sizeof(struct neighbor_entry), size);
+	if(my_neighbor_table == NULL){
+		fprintf(stderr, "Unable to initialize neighbor table with %d entries! Exiting!\n", size);
+		exit(54);
+	}
+	my_neighbor_table_size = size;
+	free_neighbor_slots(0, size);
+	rehash_neighbor_table();
+}
+
+void remove_neighbor_from_table(int slot){
+	int *link = &my_neighbor_hash[neighbor_bucket(my_neighbor_table[slot].neigh)];
+	while(*link != slot){
+		link = &my_neighbor_table[*link].hash_next;
+	}
+	*link = my_neighbor_table[slot].hash_next;
+	free_neighbor_slots(slot, slot + 1);
+	num_neighbors_stored -= 1;
+}
+
+/* remove, switch to the alternates and drop everything we learned through it */
+void neighbor_down(int slot){
+	fnaddr_t neigh = my_neighbor_table[slot].neigh;
+	remove_neighbor_from_table(slot);
+	fast_reroute(neigh);
+	rib_neighbor_down(neigh);
+}
+
+/* any frame straight from a neighbor proves it is alive. We only see the L3
+ * source, so count frames that can't have been forwarded: neighbor and dv
+ * packets never leave the link, and a MAX_TTL frame hasn't been through a hop yet
+ */
+void neighbor_heard(fnaddr_t src, uint8_t proto, uint8_t ttl){
+	int i = 0;
+	if((proto != L3_PROTO_NEIGH) && (proto != L3_PROTO_DV) && (ttl != MAX_TTL)){
+		return;
+	}
+	i = find_neighbor(src);
+	if(i < 0){
+		return;
+	}
+	my_neighbor_table[i].ttl = 120;
+	if(my_neighbor_table[i].fast_live){
+		my_neighbor_table[i].fast_deadline = now_ms() + my_neighbor_table[i].fast_detect;
+	}
+	neigh_traffic_refreshes++;
+}
+
+/* once a second per neighbor: back off while it keeps talking on its own,
+ * probe it (more and more often) once it goes quiet
+ */
+void adapt_neighbor_probe(int slot){
+	struct neighbor_entry *neighbor = &my_neighbor_table[slot];
+	int idle = 120 - neighbor->ttl;
+	if(neighbor->probe_interval == 0){
+		neighbor->probe_interval = 26;
+		neighbor->probe_due      = 26;
+	}
+	if(idle == 0){
+		if(!neighbor->probed && (neighbor->probe_interval < neigh_probe_max)){
+			neighbor->probe_interval = (neighbor->probe_interval * 2 > neigh_probe_max) ? neigh_probe_max : neighbor->probe_interval * 2;
+		}
+		neighbor->probed    = 0;
+		neighbor->probe_due = neighbor->probe_interval;
+	}
+	if(idle >= neighbor->probe_due){
+		send_neigh_request(neighbor->neigh);
+		neigh_probes_sent++;
+		neighbor->probed = 1;
+		neighbor->probe_interval = (neighbor->probe_interval / 2 < neigh_probe_min) ? neigh_probe_min : neighbor->probe_interval / 2;
+		neighbor->probe_due = idle + neighbor->probe_interval;
+	}
+}
+
+/* libfish tells us the moment a neighbor drops off fishhead. fish.h warns
+ * it misses some departures, so the timeouts above still run
+ */
+void libfish_neighbor_down(fnaddr_t neighbor){
+	int i = find_neighbor(neighbor);
+	libfish_neighbor_downs++;
+	if(i >= 0){
+		neighbor_down(i);
+	}
+	else{
+		//never made it into the table, but routes through it may exist
+		fast_reroute(neighbor);
+		rib_neighbor_down(neighbor);
+	}
+}
+
+void decrement_neighbor_table(){
+	//decrement the ttl on every valid neighbor, in every slot
+	int i = 0;
+	for(; i < my_neighbor_table_size; i++){
+		if(my_neighbor_table[i].valid){
+			adapt_neighbor_probe(i);
+			my_neighbor_table[i].ttl -= 1;
+			if(my_neighbor_table[i].ttl == 0){
+				neighbor_down(i);
+			}
+		}
+	}
+	//schedule this to happen again in 1 second!
+	fish_scheduleevent(1000, decrement_neighbor_table, 0);
+}
+
+/* resize table... checking is handled by function add_neighbor_to_table */
+void resize_neighbor_table(){
+	my_neighbor_table_size *= 2;
+
+	my_neighbor_table = realloc(my_neighbor_table, my_neighbor_table_size * sizeof(struct neighbor_entry)); 
+	if(my_neighbor_table == NULL){
+		//fprintf(stderr, "Unable to double the size of the neighbor table to %d! Exiting...\n", my_neighbor_table_size);
+		exit(1234);
+	}
+	free_neighbor_slots(my_neighbor_table_size / 2, my_neighbor_table_size);
+	rehash_neighbor_table();
+}
+
+void add_neighbor_to_table(fnaddr_t neigh){
+	int i = find_neighbor(neigh), bucket = 0, present = 0, nested = 0;
+	if(i >= 0){
+		my_neighbor_table[i].ttl = 120;
+		in_dv_table(neigh, ALL_NEIGHBORS, neigh, 0);
+		return;
+	}
+	if(neighbor_free_list < 0){
+		resize_neighbor_table();
+	}
+	i = neighbor_free_list;
+	neighbor_free_list = my_neighbor_table[i].free_next;
 	
 	my_neighbor_table[i].neigh = neigh;
 	my_neighbor_table[i].ttl   = 120;
 	my_neighbor_table[i].valid = 1;
+	my_neighbor_table[i].fast_live = 0;
+	my_neighbor_table[i].probe_interval = 0; //picked up on the next tick
+	my_neighbor_table[i].probed = 0;
+	bucket = neighbor_bucket(neigh);
+	my_neighbor_table[i].hash_next = my_neighbor_hash[bucket];
+	my_neighbor_hash[bucket] = i;
 	num_neighbors_stored += 1;
 
-	//add to dv table here---> will add to forwarding table
-	//if already in dv table, will be refreshed!
-	if(!in_dv_table(neigh, neigh, 0)){
-			add_to_dv_table(neigh, neigh, 0, ALL_NEIGHBORS, 'A');  
+	//add to dv table here---> will add to forwarding table
+	//if already in dv table, will be refreshed!
+	present = in_dv_table(neigh, ALL_NEIGHBORS, neigh, 0);
+	if(present == 0){
+			add_to_dv_table(neigh, neigh, 0, ALL_NEIGHBORS, 'A');  
+	}
+	else if(present == DV_BACKUP){
+		//we already reach it through someone else, let reconcile pick the better one
+		nested = my_dv_batch.running;
+		dv_begin_deferred();
+		add_to_dv_table(neigh, neigh, 0, ALL_NEIGHBORS, 'B');
+		dv_batch_touch(&my_dv_table[find_dv_entry(neigh, ALL_NEIGHBORS, neigh)]);
+		if(!nested){
+			dv_end_deferred();
+		}
+	}
+}
+
+void send_neigh_response(fnaddr_t source){
+	struct pkt_buf pkt;
+	struct neighbor_header *neigh = pkt_init(&pkt, NEIGH_LENGTH);
+	neigh->type = htons(NEIGH_RESPONSE);
+	
+	l3_send_pkt(&pkt, source, L3_PROTO_NEIGH, NEIGH_TTL);
+	pkt_release(&pkt);
+}
+
+void send_neigh_request(fnaddr_t dest){
+	struct pkt_buf pkt;
+	struct neighbor_header *neigh = pkt_init(&pkt, NEIGH_LENGTH);
+	neigh->type = htons(NEIGH_REQUEST);
+
+	l3_send_pkt(&pkt, dest, L3_PROTO_NEIGH, NEIGH_TTL);
+	pkt_release(&pkt);
+}
+
+void process_neighbor_packet(void *neigh_frame, fnaddr_t neigh_source, int len){
+	struct neighbor_header *neigh = (struct neighbor_header *)neigh_frame;
+	if(ntohs(neigh->type) == NEIGH_REQUEST){
+		send_neigh_response(neigh_source);
+	}
+	else if(ntohs(neigh->type) == NEIGH_FAST_HELLO){
+		process_fast_hello(neigh_frame, neigh_source, len);
+	}
+	else{
+		add_neighbor_to_table(neigh_source);
+	}	
+}
+
+void timed_neighbor_probe(){
+	/* probe the network every 30 seconds! 
+	 * NOTE: if a neighbor has not been heard from in 2 minutes, remove!
+	 */
+	//fprintf(stderr, "\nSENDING OUT A NEIGHBOR PROBE!\n");
+	int i = 0, all_busy = 1;
+	send_neigh_request(ALL_NEIGHBORS);
+	//known neighbors are looked after one by one, so once they have all backed
+	//off the broadcast is only there to find new ones
+	for(; i < my_neighbor_table_size; i++){
+		if(my_neighbor_table[i].valid && (my_neighbor_table[i].probe_interval < neigh_probe_max)){
+			all_busy = 0;
+		}
+	}
+	if(all_busy && num_neighbors_stored){
+		fish_scheduleevent(neigh_probe_max * 1000, timed_neighbor_probe, 0);
+	}
+	else{
+		fish_scheduleevent(26000, timed_neighbor_probe, 0);
+	}
+}	
+
+/* ========================================================= */
+/* ================= Fast Hello (Liveness) ================= */
+/* ========================================================= */
+/* BFD-like: with fast_hello on we broadcast a tiny hello every interval (a
+ * neighbor packet of our own type, libfish rejects protocols it doesn't know) and a
+ * neighbor that goes quiet for its own interval times its multiplier is taken
+ * down on the spot instead of after the 2 minute neighbor ttl. One timer
+ * drives both the sending and the deadline checks
+ */
+void send_fast_hello(){
+	char hello_frame[PKT_HEADROOM + FAST_HELLO_LENGTH];
+	struct fast_hello_header *hello = (struct fast_hello_header *)(hello_frame + PKT_HEADROOM);
+	struct pkt_buf pkt;
+	hello->type        = htons(NEIGH_FAST_HELLO);
+	hello->interval    = htons(fast_hello_interval);
+	hello->detect_mult = fast_hello_mult;
+	hello->flags       = 0;
+	hello->seq         = htonl(fast_hello_seq++);
+	pkt_wrap(&pkt, hello, FAST_HELLO_LENGTH);
+	l3_send_pkt(&pkt, ALL_NEIGHBORS, L3_PROTO_NEIGH, NEIGH_TTL);
+}
+
+void process_fast_hello(void *hello_frame, fnaddr_t source, int len){
+	struct fast_hello_header *hello = (struct fast_hello_header *)hello_frame;
+	int i = 0, interval = 0, detect_mult = 0;
+	if(!fast_hello || (len < FAST_HELLO_LENGTH) || (hello->interval == 0)){
+		return;
+	}
+	/* held to the same bounds as our own settings, so one odd hello can't
+	 * set a deadline that has already passed
+	 */
+	interval    = ntohs(hello->interval);
+	interval    = (interval < FAST_HELLO_MIN_MS) ? FAST_HELLO_MIN_MS : interval;
+	interval    = (interval > FAST_HELLO_MAX_MS) ? FAST_HELLO_MAX_MS : interval;
+	detect_mult = hello->detect_mult;
+	detect_mult = (detect_mult < FAST_HELLO_MULT_MIN) ? FAST_HELLO_MULT_MIN : detect_mult;
+	detect_mult = (detect_mult > FAST_HELLO_MULT_MAX) ? FAST_HELLO_MULT_MAX : detect_mult;
+	i = find_neighbor(source);
+	if(i < 0){
+		add_neighbor_to_table(source); //a hello is as good as a neighbor response
+		i = find_neighbor(source);
+	}
+	my_neighbor_table[i].ttl = 120;
+	my_neighbor_table[i].fast_live     = 1;
+	my_neighbor_table[i].fast_detect   = interval * detect_mult;
+	my_neighbor_table[i].fast_deadline = now_ms() + my_neighbor_table[i].fast_detect;
+}
+
+void fast_hello_tick(){
+	uint64_t now = now_ms();
+	int i = 0;
+	if(!fast_hello){
+		//idle until it gets turned on, forget the sessions so nothing expires later
+		for(; i < my_neighbor_table_size; i++){
+			my_neighbor_table[i].fast_live = 0;
+		}
+		fish_scheduleevent(1000, fast_hello_tick, 0);
+		return;
+	}
+	send_fast_hello();
+	for(; i < my_neighbor_table_size; i++){
+		if(my_neighbor_table[i].valid && my_neighbor_table[i].fast_live && (my_neighbor_table[i].fast_deadline < now)){
+			fprintf(stderr, "%s missed its fast hellos, taking it down\n", fn_ntoa(my_neighbor_table[i].neigh));
+			fast_hello_failures++;
+			neighbor_down(i);
+		}
+	}
+	fish_scheduleevent(fast_hello_interval, fast_hello_tick, 0);
+}
+
+/* ========================================================= */
+/* ==================== Layer 2 Receive ==================== */
+/* ========================================================= */
+/* our own fishnode_l2_receive, so the checksum over every frame runs through
+ * a vector kernel instead of a word at a time. Any kernel works on native
+ * 16 bit words, the one's complement sum comes out the same either way
+ * (RFC 1071). The kernel is picked once at startup from what the CPU has
+ */
+struct l2_receive_state my_l2;
+
+/* folds a wide sum down to 16 bits and complements it, like in_cksum */
+uint16_t cksum_fold(uint64_t sum){
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return (uint16_t)~sum;
+}
+
+/* whatever is left after the wide loads, odd byte included */
+uint64_t cksum_tail(const uint8_t *data, int len){
+	uint64_t sum = 0;
+	uint16_t word = 0;
+	for(; len >= 2; data += 2, len -= 2){
+		memcpy(&word, data, 2);
+		sum += word;
+	}
+	if(len){
+		word = 0;
+		memcpy(&word, data, 1); //pads with zero on the right, whatever the byte order
+		sum += word;
+	}
+	return sum;
+}
+
+uint16_t cksum_scalar(const void *frame, int len){
+	const uint8_t *data = frame;
+	uint64_t sum = 0, sum2 = 0, words = 0, words2 = 0;
+	for(; len >= 16; data += 16, len -= 16){
+		memcpy(&words, data, 8);
+		memcpy(&words2, data + 8, 8);
+		//four 16 bit words in 32 bit halves, the fold sorts out the carries
+		sum  += (words & 0xffffffff) + (words >> 32);
+		sum2 += (words2 & 0xffffffff) + (words2 >> 32);
+	}
+	return cksum_fold(sum + sum2 + cksum_tail(data, len));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* 16 bit words are widened into 32 bit lanes. A lane would need over a
+ * megabyte of frame to overflow and frames stop at an MTU
+ */
+__attribute__((target("sse2")))
+uint16_t cksum_sse2(const void *frame, int len){
+	const uint8_t *data = frame;
+	__m128i zero = _mm_setzero_si128(), acc = _mm_setzero_si128(), acc2 = _mm_setzero_si128(), words, words2;
+	uint32_t lanes[4];
+	for(; len >= 32; data += 32, len -= 32){
+		words  = _mm_loadu_si128((const __m128i *)data);
+		words2 = _mm_loadu_si128((const __m128i *)(data + 16));
+		acc  = _mm_add_epi32(acc, _mm_unpacklo_epi16(words, zero));
+		acc2 = _mm_add_epi32(acc2, _mm_unpackhi_epi16(words, zero));
+		acc  = _mm_add_epi32(acc, _mm_unpacklo_epi16(words2, zero));
+		acc2 = _mm_add_epi32(acc2, _mm_unpackhi_epi16(words2, zero));
+	}
+	_mm_storeu_si128((__m128i *)lanes, _mm_add_epi32(acc, acc2));
+	return cksum_fold((uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3] + cksum_tail(data, len));
+}
+
+__attribute__((target("avx2")))
+uint16_t cksum_avx2(const void *frame, int len){
+	const uint8_t *data = frame;
+	__m256i zero = _mm256_setzero_si256(), acc = _mm256_setzero_si256(), acc2 = _mm256_setzero_si256(), words, words2;
+	uint32_t lanes[8];
+	uint64_t sum = 0;
+	int i = 0;
+	for(; len >= 64; data += 64, len -= 64){
+		words  = _mm256_loadu_si256((const __m256i *)data);
+		words2 = _mm256_loadu_si256((const __m256i *)(data + 32));
+		acc  = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(words, zero));
+		acc2 = _mm256_add_epi32(acc2, _mm256_unpackhi_epi16(words, zero));
+		acc  = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(words2, zero));
+		acc2 = _mm256_add_epi32(acc2, _mm256_unpackhi_epi16(words2, zero));
+	}
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi32(acc, acc2));
+	for(; i < 8; i++){
+		sum += lanes[i];
+	}
+	return cksum_fold(sum + cksum_tail(data, len));
+}
+#endif
+
+void select_cksum_kernel(){
+	my_l2.cksum      = cksum_scalar;
+	my_l2.cksum_name = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")){
+		my_l2.cksum      = cksum_avx2;
+		my_l2.cksum_name = "avx2";
+	}
+	else if(__builtin_cpu_supports("sse2")){
+		my_l2.cksum      = cksum_sse2;
+		my_l2.cksum_name = "sse2";
+	}
+#endif
+}
+
+int my_fishnode_l2_receive(void *l2frame){
+	struct fishnet_l2_header *l2_header = (struct fishnet_l2_header *)l2frame;
+	struct fishnet_l3_header *l3_header = NULL;
+	int len = ntohs(l2_header->length), ret = 0;
+	
+	my_l2.received++;
+	/* drop frames with a bad length or checksum */
+	if((len < L2_HEADER_LENGTH) || (len > MTU)){
+		my_l2.bad_length++;
+		return 0;
+	}
+	if(my_l2.cksum(l2frame, len) != 0){
+		my_l2.bad_cksum++;
+		return 0;
+	}
+	/* and anything that isn't for us */
+	if(!FNL2_EQ(l2_header->dest, my_l2.address) && !FNL2_EQ(l2_header->dest, ALL_L2_NEIGHBORS)){
+		my_l2.not_mine++;
+		return 0;
+	}
+	l3_header = (struct fishnet_l3_header *)(l2_header + 1);
+	if(len >= L2_HEADER_LENGTH + L3_HEADER_LENGTH){
+		arp_glean_frame(l2_header->src, l3_header);
+	}
+	/* our ARP replaced libfish's, which also turned off its L2 hook for ARP frames */
+	if((len >= L2_HEADER_LENGTH + L3_HEADER_LENGTH) && (l3_header->proto == L3_PROTO_ARP) &&
+	   (fish_arp.arp_received == my_arp_received)){
+		fish_arp.arp_received(l2frame);
+		return 1;
+	}
+	my_l2.from       = l2_header->src;
+	my_l2.from_valid = 1;
+	ret = fish_l3.fish_l3_receive((uint8_t *)l2frame + L2_HEADER_LENGTH, len - L2_HEADER_LENGTH);
+	my_l2.from_valid = 0;
+	return ret;
+}
+
+/* puts the L2 header in front of a frame built with PKT_HEADROOM and sends it */
+int l2_transmit(struct pkt_buf *pkt, fn_l2addr_t dest){
+	struct fishnet_l2_header *l2_header = pkt_push(pkt, L2_HEADER_LENGTH);
+	l2_header->dest     = dest;
+	l2_header->src      = my_l2.address;
+	l2_header->length   = htons(pkt->len);
+	l2_header->checksum = 0;
+	l2_header->checksum = my_l2.cksum(l2_header, pkt->len);
+	return fish_l1_send(l2_header);
+}
+
+/* ========================================================= */
+/* ======================= ARP Cache ======================= */
+/* ========================================================= */
+/* replaces libfish's ARP. Entries are chained off a hash like the neighbor
+ * table. While an address is being resolved, every frame sent to it waits in
+ * that entry's queue behind one request (with retries), instead of each
+ * frame starting a lookup of its own. The queue is bounded, a frame that
+ * doesn't fit fails right away the same way a timed out lookup would
+ */
+struct arp_cache my_arp;
+struct fishnet_l2_header l2_broadcast_template;	//our src, dest filled in per neighbor
+
+int arp_bucket(fnaddr_t addr){
+	return fnaddr_hash(addr) & (my_arp.hash_size - 1);
+}
+
+/* returns the slot for addr, or -1 */
+int arp_find(fnaddr_t addr){
+	int i = -1;
+	if(my_arp.hash_size == 0){
+		return -1;
+	}
+	for(i = my_arp.hash[arp_bucket(addr)]; i >= 0; i = my_arp.entries[i].hash_next){
+		if(my_arp.entries[i].addr == addr){
+			break;
+		}
+	}
+	return i;
+}
+
+void arp_rehash(){
+	int i = 0, bucket = 0;
+	free(my_arp.hash);
+	my_arp.hash_size = my_arp.size * 2;
+	my_arp.hash = malloc(my_arp.hash_size * sizeof(int));
+	if(my_arp.hash == NULL){
+		exit(4302);
+	}
+	memset(my_arp.hash, 0xFF, my_arp.hash_size * sizeof(int)); //all -1
+	for(; i < my_arp.size; i++){
+		if(my_arp.entries[i].valid){
+			bucket = arp_bucket(my_arp.entries[i].addr);
+			my_arp.entries[i].hash_next = my_arp.hash[bucket];
+			my_arp.hash[bucket] = i;
+		}
+	}
+}
+
+/* doubles the table (or makes the first one) and frees the new slots */
+void arp_grow(){
+	int old_size = my_arp.size, i = 0;
+	my_arp.size = (old_size == 0) ? 32 : old_size * 2;
+	my_arp.entries = realloc(my_arp.entries, my_arp.size * sizeof(struct arp_entry));
+	if(my_arp.entries == NULL){
+		exit(4301);
+	}
+	memset(&my_arp.entries[old_size], 0, (my_arp.size - old_size) * sizeof(struct arp_entry));
+	for(i = my_arp.size - 1; i >= old_size; i--){
+		my_arp.entries[i].free_next = my_arp.free_list;
+		my_arp.free_list = i;
+	}
+	arp_rehash();
+}
+
+int arp_add(fnaddr_t addr){
+	int i = 0, bucket = 0;
+	if(my_arp.free_list < 0){
+		arp_grow();
+	}
+	i = my_arp.free_list;
+	my_arp.free_list = my_arp.entries[i].free_next;
+	memset(&my_arp.entries[i], 0, sizeof(struct arp_entry));
+	my_arp.entries[i].addr  = addr;
+	my_arp.entries[i].valid = 1;
+	bucket = arp_bucket(addr);
+	my_arp.entries[i].hash_next = my_arp.hash[bucket];
+	my_arp.hash[bucket] = i;
+	my_arp.num_entries++;
+	return i;
+}
+
+void arp_remove(int slot){
+	int *link = &my_arp.hash[arp_bucket(my_arp.entries[slot].addr)];
+	while(*link != slot){
+		link = &my_arp.entries[*link].hash_next;
+	}
+	*link = my_arp.entries[slot].hash_next;
+	free(my_arp.entries[slot].queue);
+	my_arp.entries[slot].queue     = NULL;
+	my_arp.entries[slot].valid     = 0;
+	my_arp.entries[slot].free_next = my_arp.free_list;
+	my_arp.free_list = slot;
+	my_arp.num_entries--;
+}
+
+/* hands every waiting frame its answer, an invalid address if the lookup failed.
+ * The queue is taken off the entry first, the callbacks are free to send again
+ */
+void arp_release_waiters(int slot, fn_l2addr_t l2addr){
+	struct arp_waiter *queue = my_arp.entries[slot].queue;
+	int num_waiting = my_arp.entries[slot].num_waiting, i = 0;
+	my_arp.entries[slot].queue       = NULL;
+	my_arp.entries[slot].queue_size  = 0;
+	my_arp.entries[slot].num_waiting = 0;
+	my_arp.num_waiting -= num_waiting;
+	for(; i < num_waiting; i++){
+		queue[i].cb(l2addr, queue[i].param);
+	}
+	free(queue);
+}
+
+void my_add_arp_entry(fn_l2addr_t l2addr, fnaddr_t addr, int timeout){
+	int i = arp_find(addr);
+	if(i < 0){
+		i = arp_add(addr);
+	}
+	my_arp.entries[i].l2addr     = l2addr;
+	my_arp.entries[i].resolved   = 1;
+	my_arp.entries[i].pending    = 0;
+	my_arp.entries[i].refreshing = 0;
+	my_arp.entries[i].expires    = now_ms() + (uint64_t)timeout * 1000;
+	//the header our fish_l2_send stamps on frames for this neighbor
+	my_arp.entries[i].l2_template      = l2_broadcast_template;
+	my_arp.entries[i].l2_template.dest = l2addr;
+	if(my_arp.entries[i].num_waiting){
+		arp_release_waiters(i, l2addr);
+	}
+}
+
+/* the slot of a usable answer for addr, counted as a use, or -1 */
+int arp_cached(fnaddr_t addr){
+	uint64_t now = now_ms();
+	int i = arp_find(addr);
+	if((i < 0) || !my_arp.entries[i].resolved || (my_arp.entries[i].expires <= now)){
+		return -1;
+	}
+	my_arp.hits++;
+	my_arp.entries[i].uses++;
+	my_arp.entries[i].last_used = now;
+	return i;
+}
+
+void my_resolve_fnaddr(fnaddr_t addr, arp_resolution_cb cb, void *param){
+	fn_l2addr_t invalid;
+	struct arp_entry *entry = NULL;
+	uint64_t now = now_ms();
+	int i = 0;
+	if(addr == ALL_NEIGHBORS){
+		cb(ALL_L2_NEIGHBORS, param);
+		return;
+	}
+	i = arp_cached(addr);
+	if(i >= 0){
+		cb(my_arp.entries[i].l2addr, param);
+		return;
+	}
+	i = arp_find(addr);
+	if(i < 0){
+		i = arp_add(addr);
+	}
+	entry = &my_arp.entries[i];
+	entry->resolved = 0;
+	//arp_queue can change while frames wait, the queue only holds what it was sized for
+	if((entry->num_waiting >= arp_queue) || ((entry->queue != NULL) && (entry->num_waiting >= entry->queue_size))){
+		my_arp.queue_drops++;
+		memset(&invalid, 0, sizeof(invalid));
+		cb(invalid, param);
+		return;
+	}
+	if(entry->queue == NULL){
+		entry->queue = malloc(arp_queue * sizeof(struct arp_waiter));
+		if(entry->queue == NULL){
+			exit(4303);
+		}
+		entry->queue_size = arp_queue;
+	}
+	entry->queue[entry->num_waiting].cb    = cb;
+	entry->queue[entry->num_waiting].param = param;
+	entry->num_waiting++;
+	my_arp.num_waiting++;
+	my_arp.queued++;
+	
+	/* the first frame to wait starts the lookup, the rest ride along */
+	if(!entry->pending){
+		entry->pending  = 1;
+		entry->tries    = 1;
+		entry->retry_at = now + ARP_RETRY_MS;
+		fish_arp.send_arp_request(addr);
+	}
+}
+
+/* starts a lookup nobody is waiting on yet, so the answer is cached by the
+ * time traffic shows up. Used for the next hop of every new route
+ */
+void arp_prefetch(fnaddr_t addr){
+	int i = 0;
+	if((addr == 0) || (addr == ALL_NEIGHBORS) || (addr == fish_getaddress()) || (my_arp.hash_size == 0)){
+		return;
+	}
+	i = arp_find(addr);
+	if((i >= 0) && (my_arp.entries[i].pending || (my_arp.entries[i].resolved && (my_arp.entries[i].expires > now_ms())))){
+		return;
+	}
+	if(i < 0){
+		i = arp_add(addr);
+	}
+	my_arp.entries[i].resolved = 0;
+	my_arp.entries[i].pending  = 1;
+	my_arp.entries[i].tries    = 1;
+	my_arp.entries[i].retry_at = now_ms() + ARP_RETRY_MS;
+	my_arp.prefetches++;
+	fish_arp.send_arp_request(addr);
+}
+
+/* learns a neighbor's L2 address from a frame it sent us. Only frames the
+ * L2 sender built itself count: the link local protocols, which are never
+ * forwarded, or anything still at the full TTL. A mapping we already have is
+ * just extended, at most every arp_glean seconds. New and changed ones also
+ * go through a token bucket, so a neighbor flapping between addresses or
+ * sending from many sources can't churn the cache
+ */
+void arp_glean_frame(fn_l2addr_t l2addr, struct fishnet_l3_header *l3_header){
+	fnaddr_t src = l3_header->src;
+	uint64_t now = 0;
+	int i = 0;
+	if(!arp_glean){
+		return;
+	}
+	if((l3_header->proto != L3_PROTO_NEIGH) && (l3_header->proto != L3_PROTO_DV) &&
+	   (l3_header->proto != L3_PROTO_ARP) && (l3_header->ttl != MAX_TTL)){
+		return;
+	}
+	if((src == 0) || (src == ALL_NEIGHBORS) || (src == fish_getaddress()) ||
+	   !FNL2_VALID(l2addr) || FNL2_EQ(l2addr, ALL_L2_NEIGHBORS) || FNL2_EQ(l2addr, my_l2.address)){
+		return;
+	}
+	now = now_ms();
+	i = arp_find(src);
+	if((i >= 0) && (my_arp.entries[i].gleaned_at + (uint64_t)arp_glean * 1000 > now)){
+		if(!my_arp.entries[i].resolved || !FNL2_EQ(my_arp.entries[i].l2addr, l2addr)){
+			my_arp.glean_limited++;
+		}
+		return;
+	}
+	if(((i < 0) || !my_arp.entries[i].resolved || !FNL2_EQ(my_arp.entries[i].l2addr, l2addr)) &&
+	   !token_bucket_take(&my_arp.glean_bucket, arp_glean_rate, arp_glean_rate, now)){
+		my_arp.glean_limited++;
+		return;
+	}
+	fish_arp.add_arp_entry(l2addr, src, ARP_TIMEOUT);
+	i = arp_find(src);
+	if(i >= 0){
+		my_arp.entries[i].gleaned_at = now;
+	}
+	my_arp.gleaned++;
+}
+
+/* ARP frames only ever cross one link, so they are built down to L2 right here */
+int arp_send(fnaddr_t dest, fn_l2addr_t l2dest, uint32_t type, fnaddr_t addr, fn_l2addr_t l2addr){
+	struct pkt_buf pkt;
+	struct arp_header *arp = pkt_init(&pkt, ARP_HEADER_LENGTH);
+	struct fishnet_l3_header *l3_header = NULL;
+	int ret = 0;
+	arp->type   = htonl(type);
+	arp->addr   = addr;
+	arp->l2addr = l2addr;
+	
+	l3_header = pkt_push(&pkt, L3_HEADER_LENGTH);
+	l3_header->ttl   = 1;
+	l3_header->proto = L3_PROTO_ARP;
+	l3_header->id    = htonl(fish_next_pktid());
+	l3_header->src   = fish_getaddress();
+	l3_header->dest  = dest;
+	ret = l2_transmit(&pkt, l2dest);
+	pkt_release(&pkt);
+	return ret;
+}
+
+void my_send_arp_request(fnaddr_t l3addr){
+	fn_l2addr_t unknown;
+	memset(&unknown, 0, sizeof(unknown));
+	my_arp.requests++;
+	arp_send(ALL_NEIGHBORS, ALL_L2_NEIGHBORS, ARP_REQUEST, l3addr, unknown);
+}
+
+/* called from our L2 receive for ARP frames addressed to us or broadcast */
+void my_arp_received(void *l2frame){
+	struct fishnet_l2_header *l2_header = (struct fishnet_l2_header *)l2frame;
+	struct fishnet_l3_header *l3_header = (struct fishnet_l3_header *)(l2_header + 1);
+	struct arp_header *arp = (struct arp_header *)(l3_header + 1);
+	
+	if(ntohs(l2_header->length) < L2_HEADER_LENGTH + L3_HEADER_LENGTH + ARP_HEADER_LENGTH){
+		return;
+	}
+	if(ntohl(arp->type) == ARP_REQUEST){
+		if(arp->addr == fish_getaddress()){
+			arp_send(l3_header->src, l2_header->src, ARP_RESPONSE, arp->addr, fish_getl2address());
+		}
+	}
+	else if(ntohl(arp->type) == ARP_RESPONSE){
+		my_arp.responses++;
+		fish_arp.add_arp_entry(arp->l2addr, arp->addr, ARP_TIMEOUT);
+	}
+}
+
+/* retries outstanding lookups, gives up after ARP_TRIES and drops expired entries.
+ * An entry that traffic is still using gets asked again arp_refresh seconds
+ * before it runs out. It keeps answering from the old address meanwhile, so
+ * a busy next hop never stalls on an expiry
+ */
+void arp_tick(){
+	fn_l2addr_t invalid;
+	struct arp_entry *entry = NULL;
+	uint64_t now = now_ms();
+	int i = 0;
+	memset(&invalid, 0, sizeof(invalid));
+	for(; i < my_arp.size; i++){
+		entry = &my_arp.entries[i];
+		if(!entry->valid){
+			continue;
+		}
+		if(entry->pending && (entry->retry_at <= now)){
+			if(entry->tries < ARP_TRIES){
+				entry->tries++;
+				entry->retry_at = now + ARP_RETRY_MS;
+				fish_arp.send_arp_request(entry->addr);
+				continue;
+			}
+			my_arp.failures++;
+			entry->pending = 0;
+			arp_release_waiters(i, invalid);
+			//a callback may have asked again, leave the entry for that lookup
+			if(!my_arp.entries[i].pending){
+				arp_remove(i);
+			}
+		}
+		else if(!entry->pending && entry->resolved && (entry->expires <= now)){
+			arp_remove(i);
+		}
+		else if(entry->refreshing && (entry->retry_at <= now)){
+			if(entry->tries < ARP_TRIES){
+				entry->tries++;
+				entry->retry_at = now + ARP_RETRY_MS;
+				fish_arp.send_arp_request(entry->addr);
+			}
+			else{
+				entry->refreshing = 0; //no answer, it expires like any other
+			}
+		}
+		else if(arp_refresh && entry->resolved && !entry->pending && !entry->refreshing &&
+			(entry->expires <= now + (uint64_t)arp_refresh * 1000) &&
+			(entry->last_used + ARP_HOT_MS > now)){
+			entry->refreshing = 1;
+			entry->tries      = 1;
+			entry->retry_at   = now + ARP_RETRY_MS;
+			my_arp.refreshes++;
+			fish_arp.send_arp_request(entry->addr);
+		}
+	}
+	fish_scheduleevent(ARP_TICK_MS, arp_tick, 0);
+}
+
+void print_my_arp_table(){
+	uint64_t now = now_ms();
+	int i = 0;
+	fprintf(stdout, "\n"
+		"                         ARP CACHE                         \n"
+		" ========================================================= \n"
+		"     L3 Address           L2 Address       TTL   Waiting     Uses  \n"
+		" ----------------   -------------------   -----  -------  -------  \n");
+	for(; i < my_arp.size; i++){
+		if(!my_arp.entries[i].valid){
+			continue;
+		}
+		if(my_arp.entries[i].resolved){
+			fprintf(stdout, " %16s   %19s   %5d  %7d  %7lu%s\n", fn_ntoa(my_arp.entries[i].addr),
+				fnl2_ntoa(my_arp.entries[i].l2addr),
+				(my_arp.entries[i].expires > now) ? (int)((my_arp.entries[i].expires - now) / 1000) : 0,
+				my_arp.entries[i].num_waiting,
+				my_arp.entries[i].uses,
+				my_arp.entries[i].refreshing ? "  refreshing" : "");
+		}
+		else{
+			fprintf(stdout, " %16s   %19s   %5s  %7d  %7lu\n", fn_ntoa(my_arp.entries[i].addr),
+				"(resolving)", "-", my_arp.entries[i].num_waiting, my_arp.entries[i].uses);
+		}
 	}
+	fprintf(stdout, "%d entries, %d frames waiting (at most %d per address)\n", my_arp.num_entries, my_arp.num_waiting, arp_queue);
+	fprintf(stdout, "%lu hits, %lu frames queued, %lu dropped on a full queue\n", my_arp.hits, my_arp.queued, my_arp.queue_drops);
+	fprintf(stdout, "%lu requests sent, %lu responses, %lu lookups failed\n", my_arp.requests, my_arp.responses, my_arp.failures);
+	fprintf(stdout, "%lu refreshed in use, %lu resolved ahead for new routes\n", my_arp.refreshes, my_arp.prefetches);
+	fprintf(stdout, "%lu learned from received frames, %lu held back by the glean limits\n", my_arp.gleaned, my_arp.glean_limited);
 }
 
-void send_neigh_response(fnaddr_t source){
-	void *neighbor_packet = malloc(L2_HEADER_LENGTH + L3_HEADER_LENGTH + sizeof(struct neighbor_header));
-	if(neighbor_packet == NULL){
-		//fprintf(stderr, "Unable to malloc for neighbor response packet, Exiting!\n");
-		exit(667);
+/* ========================================================= */
+/* ===================== Layer 2 Send ====================== */
+/* ========================================================= */
+/* our fish_l2_send. Every resolved ARP entry carries a ready made L2 header
+ * for its neighbor (rebuilt whenever the entry is answered), so a frame to a
+ * known neighbor takes a 16 byte copy, the length and checksum, and
+ * fish_l1_send. Our own frames already have the room for it in front,
+ * anything else is copied into a pool buffer first
+ */
+/* the frame with its L2 header slot in front, held for us. Ours is just
+ * referenced again, anyone else's gets copied behind fresh headroom. NULL,
+ * counted, when the pool is exhausted
+ */
+void *l2_hold_with_headroom(void *l3frame, int len){
+	struct pool_buf *buf = pool_buf_of(l3frame);
+	uint8_t *copy = NULL;
+	if((buf != NULL) && ((uint8_t *)l3frame - L2_HEADER_LENGTH >= (uint8_t *)(buf + 1))){
+		return frame_hold(l3frame, len);
 	}
-	neighbor_packet += L2_HEADER_LENGTH + L3_HEADER_LENGTH;//set pointer to point to neigh packet
-	
-	struct neighbor_header *neigh = (struct neighbor_header *)neighbor_packet;
-	neigh->type = htons(NEIGH_RESPONSE);
-	
-	fish_l3.fish_l3_send(neighbor_packet, NEIGH_LENGTH, source, L3_PROTO_NEIGH, NEIGH_TTL);
+	copy = pool_get();
+	if(copy == NULL){
+		my_l2.no_buffer++;
+		return NULL;
+	}
+	memcpy(copy + L2_HEADER_LENGTH, l3frame, len);
+	my_l2.send_copies++;
+	return copy + L2_HEADER_LENGTH;
 }
 
-void send_neigh_request(){
-	void *neighbor_packet = malloc(L2_HEADER_LENGTH + L3_HEADER_LENGTH + sizeof(struct neighbor_header));
-	
-	if(neighbor_packet == NULL){
-		//fprintf(stderr, "Unable to malloc for neighbor request packet, Exiting!\n");
-		exit(666);
+/* stamps the template in front of a held frame and sends it */
+int l2_send_with_template(void *l3frame, int len, struct fishnet_l2_header *template){
+	struct fishnet_l2_header *l2_header = (struct fishnet_l2_header *)((uint8_t *)l3frame - L2_HEADER_LENGTH);
+	memcpy(l2_header, template, L2_HEADER_LENGTH);
+	l2_header->length   = htons(len + L2_HEADER_LENGTH);
+	l2_header->checksum = 0;
+	l2_header->checksum = my_l2.cksum(l2_header, len + L2_HEADER_LENGTH);
+	my_l2.sent++;
+	return fish_l1_send(l2_header);
+}
+
+void l2_send_resolved(fn_l2addr_t l2addr, void *param){
+	struct l2_pending *pending = param;
+	struct fishnet_l2_header template;
+	if(FNL2_VALID(l2addr)){
+		template = l2_broadcast_template;
+		template.dest = l2addr;
+		l2_send_with_template(pending->l3frame, pending->len, &template);
 	}
-	neighbor_packet += L2_HEADER_LENGTH + L3_HEADER_LENGTH;//set pointer to point to neigh packet
-	
-	struct neighbor_header *neigh = (struct neighbor_header *)neighbor_packet;
-	neigh->type = htons(NEIGH_REQUEST);
+	else{
+		//the spec's L2 error: nobody answered for the next hop
+		my_l2.host_unreachable++;
+		fcmp_error(pending->l3frame, pending->len, FCMP_HOST_UNREACHABLE);
+	}
+	frame_release(pending->l3frame);
+	free(pending);
+}
+
+/* sends a frame already held with headroom, and lets go of it */
+int l2_output(void *held, fnaddr_t next_hop, int len){
+	struct l2_pending *pending = NULL;
+	int slot = -1, ret = 0;
+	if(next_hop == ALL_NEIGHBORS){
+		ret = l2_send_with_template(held, len, &l2_broadcast_template);
+	}
+	else if((slot = arp_cached(next_hop)) >= 0){
+		ret = l2_send_with_template(held, len, &my_arp.entries[slot].l2_template);
+	}
+	else{
+		/* park it behind the lookup, the callback sends or drops it */
+		pending = malloc(sizeof(struct l2_pending));
+		if(pending == NULL){
+			exit(4501);
+		}
+		pending->l3frame  = held;
+		pending->len      = len;
+		pending->next_hop = next_hop;
+		my_l2.arp_waits++;
+		fish_arp.resolve_fnaddr(next_hop, l2_send_resolved, pending);
+		return 1;
+	}
+	frame_release(held);
+	return ret;
+}
 
-	fish_l3.fish_l3_send(neigh, NEIGH_LENGTH, ALL_NEIGHBORS, L3_PROTO_NEIGH, NEIGH_TTL);
+void print_my_l2(){
+	fprintf(stdout, "L2 checksum kernel: %s\n", my_l2.cksum_name);
+	fprintf(stdout, "%lu frames received, dropped %lu bad checksums, %lu bad lengths, %lu for someone else\n",
+		my_l2.received, my_l2.bad_cksum, my_l2.bad_length, my_l2.not_mine);
+	fprintf(stdout, "%lu frames sent, %lu copied for headroom, %lu waited on ARP, %lu host unreachable, %lu too big, %lu without a buffer\n",
+		my_l2.sent, my_l2.send_copies, my_l2.arp_waits, my_l2.host_unreachable, my_l2.too_big, my_l2.no_buffer);
 }
 
-void process_neighbor_packet(void *neigh_frame, fnaddr_t neigh_source, int len){
-	struct neighbor_header *neigh = (struct neighbor_header *)neigh_frame;
-	if(ntohs(neigh->type) == NEIGH_REQUEST){
-		send_neigh_response(neigh_source);
+/* ========================================================= */
+/* ==================== Egress Scheduler =================== */
+/* ========================================================= */
+/* frames handed to our fish_l2_send wait in one queue per class and go out
+ * from the event loop, egress_budget at a time, always the highest class
+ * first. A burst of forwarded data can then only delay hellos and DV updates
+ * by one turn of the loop, and a data queue that overflows drops data, not
+ * control. ARP builds its own frames and skips the queues altogether
+ */
+struct egress_scheduler my_egress;
+int *egress_depth[EGRESS_CLASSES] = {&egress_control_depth, &egress_signal_depth, &egress_data_depth};
+const char *egress_names[EGRESS_CLASSES] = {"control", "signal", "data"};
+
+void egress_init(){
+	memset(my_egress.class_of, EGRESS_DATA, sizeof(my_egress.class_of));
+	my_egress.class_of[L3_PROTO_NEIGH] = EGRESS_CONTROL;
+	my_egress.class_of[L3_PROTO_DV]    = EGRESS_CONTROL;
+	my_egress.class_of[L3_PROTO_ARP]   = EGRESS_CONTROL;
+	my_egress.class_of[L3_PROTO_FCMP]  = EGRESS_SIGNAL;
+	my_egress.class_of[L3_PROTO_NAME]  = EGRESS_SIGNAL;
+}
+
+/* our fish_l2_send: classify by proto, queue, and let the drain send it. With
+ * egress_sched on, 1 only means the frame got into its queue, a full queue is
+ * the one drop reported here
+ */
+int my_fish_l2_send(void *l3frame, fnaddr_t next_hop, int len){
+	struct fishnet_l3_header *l3_header = (struct fishnet_l3_header *)l3frame;
+	struct egress_queue *queue = NULL;
+	void *held = NULL;
+	if(len + L2_HEADER_LENGTH > MTU){
+		my_l2.too_big++;
+		return 0;
+	}
+	if(!egress_sched){
+		held = l2_hold_with_headroom(l3frame, len);
+		return (held == NULL) ? 0 : l2_output(held, next_hop, len);
+	}
+	queue = &my_egress.queues[my_egress.class_of[l3_header->proto]];
+	if(queue->count >= *egress_depth[queue - my_egress.queues]){
+		queue->dropped++;
+		return 0;
+	}
+	held = l2_hold_with_headroom(l3frame, len);
+	if(held == NULL){
+		return 0;
+	}
+	if(queue->frames == NULL){
+		queue->frames = malloc(EGRESS_DEPTH_MAX * sizeof(struct egress_frame));
+		if(queue->frames == NULL){
+			exit(4801);
+		}
+	}
+	queue->frames[(queue->head + queue->count) & (EGRESS_DEPTH_MAX - 1)] = (struct egress_frame){held, len, next_hop};
+	queue->count++;
+	queue->queued++;
+	if(queue->count > queue->high_water){
+		queue->high_water = queue->count;
+	}
+	if(!my_egress.scheduled){
+		my_egress.scheduled = 1;
+		fish_scheduleevent(0, egress_drain, 0);
+	}
+	return 1;
+}
+
+void egress_drain(){
+	struct egress_queue *queue = NULL;
+	struct egress_frame frame;
+	int budget = egress_budget, i = 0;
+	my_egress.scheduled = 0;
+	my_egress.drains++;
+	for(; (i < EGRESS_CLASSES) && budget; i++){
+		queue = &my_egress.queues[i];
+		while(queue->count && budget){
+			frame = queue->frames[queue->head];
+			queue->head = (queue->head + 1) & (EGRESS_DEPTH_MAX - 1);
+			queue->count--;
+			queue->sent++;
+			budget--;
+			l2_output(frame.l3frame, frame.next_hop, frame.len);
+			//a send can queue more (an FCMP error), so look from the top again
+			if(i > EGRESS_CONTROL){
+				i = -1;
+				break;
+			}
+		}
+	}
+	for(i = 0; i < EGRESS_CLASSES; i++){
+		if(my_egress.queues[i].count && !my_egress.scheduled){
+			my_egress.scheduled = 1;
+			fish_scheduleevent(0, egress_drain, 0);
+		}
+	}
+}
+
+void print_my_egress(){
+	struct egress_queue *queue = NULL;
+	int i = 0;
+	fprintf(stdout, "\n"
+		"                      EGRESS SCHEDULER                     \n"
+		" ========================================================= \n");
+	if(!egress_sched){
+		fprintf(stdout, " Off, frames go straight out\n");
+	}
+	fprintf(stdout, " Class     Depth  Queued  High Water     Total       Sent   Dropped\n"
+		" -------   -----  ------  ----------  --------  ---------  --------\n");
+	for(; i < EGRESS_CLASSES; i++){
+		queue = &my_egress.queues[i];
+		fprintf(stdout, " %-7s   %5d  %6d  %10d  %8lu  %9lu  %8lu\n", egress_names[i], *egress_depth[i],
+			queue->count, queue->high_water, queue->queued, queue->sent, queue->dropped);
+	}
+	fprintf(stdout, "%lu drains, at most %d frames each\n", my_egress.drains, egress_budget);
+}
+
+/* ========================================================= */
+/* ==================== Next Hop Pacing ==================== */
+/* ========================================================= */
+/* forwarded frames get a queue per next hop, paced out at nh_pace_rate
+ * bytes per second each. Whatever doesn't fit in nh_queue_bytes is dropped
+ * and counted against that next hop alone, so a slow link can only back up
+ * its own traffic and never holds more than its byte limit. The limit is on
+ * the pool buffers the waiting frames pin, a whole POOL_BUF_SIZE each. Only
+ * transit frames are paced: what we originate (neighbor probes and answers,
+ * DV advertisements, FCMP) goes straight to fish_l2_send and its egress
+ * class. With pacing off everything goes straight through
+ */
+struct nh_queue_table my_nh_queues;
+
+/* the queue for next_hop, made on first use */
+struct nh_queue *nh_queue_get(fnaddr_t next_hop){
+	int bucket = fnaddr_hash(next_hop) & (NH_HASH_SIZE - 1), i = 0;
+	if(my_nh_queues.size == 0){
+		memset(my_nh_queues.hash, 0xFF, sizeof(my_nh_queues.hash)); //all -1
+	}
+	for(i = my_nh_queues.hash[bucket]; i >= 0; i = my_nh_queues.queues[i].hash_next){
+		if(my_nh_queues.queues[i].next_hop == next_hop){
+			return &my_nh_queues.queues[i];
+		}
+	}
+	if(my_nh_queues.num_queues >= my_nh_queues.size){
+		my_nh_queues.size = (my_nh_queues.size == 0) ? 8 : my_nh_queues.size * 2;
+		my_nh_queues.queues = realloc(my_nh_queues.queues, my_nh_queues.size * sizeof(struct nh_queue));
+		if(my_nh_queues.queues == NULL){
+			exit(4901);
+		}
+	}
+	i = my_nh_queues.num_queues++;
+	memset(&my_nh_queues.queues[i], 0, sizeof(struct nh_queue));
+	my_nh_queues.queues[i].next_hop = next_hop;
+	my_nh_queues.queues[i].bucket.tokens  = (uint64_t)nh_pace_burst * 1000; //starts full
+	my_nh_queues.queues[i].bucket.last_ms = now_ms();
+	my_nh_queues.queues[i].hash_next = my_nh_queues.hash[bucket];
+	my_nh_queues.hash[bucket] = i;
+	return &my_nh_queues.queues[i];
+}
+
+void nh_queue_push(struct nh_queue *queue, void *held, int len){
+	int i = 0;
+	if(queue->count == queue->size){
+		//unroll the ring into the bigger one
+		struct egress_frame *frames = malloc((queue->size ? queue->size * 2 : 16) * sizeof(struct egress_frame));
+		if(frames == NULL){
+			exit(4902);
+		}
+		for(; i < queue->count; i++){
+			frames[i] = queue->frames[(queue->head + i) % queue->size];
+		}
+		free(queue->frames);
+		queue->frames = frames;
+		queue->head   = 0;
+		queue->size   = queue->size ? queue->size * 2 : 16;
+	}
+	queue->frames[(queue->head + queue->count) % queue->size] = (struct egress_frame){held, len, queue->next_hop};
+	queue->count++;
+	queue->bytes += len;
+	if(queue->bytes > queue->high_water){
+		queue->high_water = queue->bytes;
+	}
+}
+
+int nh_queue_send(void *l3frame, int len, fnaddr_t next_hop){
+	struct fishnet_l3_header *l3_header = (struct fishnet_l3_header *)l3frame;
+	struct nh_queue *queue = NULL;
+	void *held = NULL;
+	if(!nh_pace_rate || (next_hop == ALL_NEIGHBORS) || (l3_header->src == fish_getaddress())){
+		return fish_l2.fish_l2_send(l3frame, next_hop, len);
+	}
+	queue = nh_queue_get(next_hop);
+	/* nothing ahead of it and the budget is there, straight out */
+	if((queue->count == 0) && token_bucket_take_n(&queue->bucket, nh_pace_rate, nh_pace_burst, len, now_ms())){
+		queue->sent++;
+		return fish_l2.fish_l2_send(l3frame, next_hop, len);
+	}
+	if((queue->count + 1) * POOL_BUF_SIZE > nh_queue_bytes){
+		queue->dropped++;
+		queue->dropped_bytes += len;
+		return 0;
+	}
+	held = frame_hold(l3frame, len);
+	if(held == NULL){
+		queue->dropped++;
+		queue->dropped_bytes += len;
+		return 0;
+	}
+	if(queue->count == 0){
+		my_nh_queues.backlogged++;
+	}
+	nh_queue_push(queue, held, len);
+	queue->paced++;
+	if(!my_nh_queues.scheduled){
+		my_nh_queues.scheduled = 1;
+		fish_scheduleevent(NH_PACE_MS, nh_pace_tick, 0);
+	}
+	return 1;
+}
+
+/* sends what each backlogged next hop's budget allows, and comes back while any wait */
+void nh_pace_tick(){
+	struct nh_queue *queue = NULL;
+	struct egress_frame frame;
+	uint64_t now = now_ms();
+	int i = 0;
+	my_nh_queues.scheduled = 0;
+	for(; i < my_nh_queues.num_queues; i++){
+		queue = &my_nh_queues.queues[i];
+		while(queue->count){
+			frame = queue->frames[queue->head];
+			//pacing turned off meanwhile lets the whole backlog go
+			if(nh_pace_rate && !token_bucket_take_n(&queue->bucket, nh_pace_rate, nh_pace_burst, frame.len, now)){
+				break;
+			}
+			queue->head = (queue->head + 1) % queue->size;
+			queue->count--;
+			queue->bytes -= frame.len;
+			queue->sent++;
+			fish_l2.fish_l2_send(frame.l3frame, frame.next_hop, frame.len);
+			frame_release(frame.l3frame);
+			if(queue->count == 0){
+				my_nh_queues.backlogged--;
+			}
+		}
+	}
+	if(my_nh_queues.backlogged){
+		my_nh_queues.scheduled = 1;
+		fish_scheduleevent(NH_PACE_MS, nh_pace_tick, 0);
+	}
+}
+
+void print_my_nh_queues(){
+	struct nh_queue *queue = NULL;
+	int i = 0;
+	fprintf(stdout, "\n"
+		"                     NEXT HOP PACING                       \n"
+		" ========================================================= \n");
+	if(nh_pace_rate){
+		fprintf(stdout, " %d bytes/s per next hop, bursts of %d bytes, %d bytes of buffers can wait\n",
+			nh_pace_rate, nh_pace_burst, nh_queue_bytes);
 	}
 	else{
-		add_neighbor_to_table(neigh_source);
-	}	
+		fprintf(stdout, " Off, forwarded frames go straight out\n");
+	}
+	fprintf(stdout, "         Next Hop   Waiting    Bytes  High Water      Sent     Paced  Dropped  Dropped Bytes\n"
+		" ----------------   -------  -------  ----------  --------  --------  -------  -------------\n");
+	for(; i < my_nh_queues.num_queues; i++){
+		queue = &my_nh_queues.queues[i];
+		fprintf(stdout, " %16s   %7d  %7d  %10d  %8lu  %8lu  %7lu  %13lu\n", fn_ntoa(queue->next_hop),
+			queue->count, queue->bytes, queue->high_water, queue->sent, queue->paced,
+			queue->dropped, queue->dropped_bytes);
+	}
 }
 
-void timed_neighbor_probe(){
-	/* probe the network every 30 seconds! 
-	 * NOTE: if a neighbor has not been heard from in 2 minutes, remove!
-	 */
-	//fprintf(stderr, "\nSENDING OUT A NEIGHBOR PROBE!\n");
-	send_neigh_request();
-	fish_scheduleevent(26000, timed_neighbor_probe, 0);
-}	
+/* ========================================================= */
+/* ================= FCMP Error Rate Limiting ============== */
+/* ========================================================= */
+/* every dropped frame used to get its own FCMP error, so losing a busy route
+ * doubled the work right when things were already bad. Errors now spend a
+ * token from their source's bucket and one from the global bucket. A
+ * source hashes to a fixed slot and a new source takes the slot over,
+ * so the table never grows. The bucket stays with the slot, sources that
+ * collide share it rather than handing each other a full one. A rate of 0
+ * turns that limit off
+ */
+struct fcmp_limiter my_fcmp_limiter;
+
+/* refills for the time since it was last used, then takes a token if there is one */
+int token_bucket_take(struct token_bucket *bucket, int rate, int burst, uint64_t now){
+	return token_bucket_take_n(bucket, rate, burst, 1, now);
+}
+
+/* takes cost tokens at once (bytes for pacing), or none if there aren't that many */
+int token_bucket_take_n(struct token_bucket *bucket, int rate, int burst, int cost, uint64_t now){
+	uint64_t tokens = bucket->tokens;
+	if(rate == 0){
+		return 1;
+	}
+	//tokens are kept in thousandths, so one ms at rate per second is rate of them
+	tokens += (now - bucket->last_ms) * rate;
+	if(tokens > (uint64_t)burst * 1000){
+		tokens = (uint64_t)burst * 1000;
+	}
+	bucket->last_ms = now;
+	if(tokens < (uint64_t)cost * 1000){
+		bucket->tokens = tokens;
+		return 0;
+	}
+	bucket->tokens = tokens - (uint64_t)cost * 1000;
+	return 1;
+}
+
+struct fcmp_source *fcmp_source_of(fnaddr_t src, uint64_t now){
+	uint32_t hash = ntohl(src) * 0x9e3779b1u; //host order, so the bits that vary get spread
+	struct fcmp_source *source = &my_fcmp_limiter.sources[(hash ^ (hash >> 16)) & (FCMP_SOURCES - 1)];
+	if(!source->valid){
+		source->valid          = 1;
+		source->src            = src;
+		source->bucket.tokens  = fcmp_src_burst * 1000; //a fresh slot starts full
+		source->bucket.last_ms = now;
+	}
+	else if(source->src != src){
+		//taken over: new counters, same bucket
+		source->src        = src;
+		source->sent       = 0;
+		source->suppressed = 0;
+	}
+	return source;
+}
+
+/* sends an FCMP error for a dropped frame unless its source or the node is over the limit */
+int fcmp_error(void *l3frame, int len, uint32_t error){
+	struct fishnet_l3_header *l3_header = (struct fishnet_l3_header *)l3frame;
+	struct fcmp_source *source = NULL;
+	uint64_t now = now_ms();
+	int kind = (error < FCMP_KINDS) ? error : 0;
+	
+	//send_fcmp_response never answers these, so they cost nothing and count for nothing
+	if((l3_header->dest == ALL_NEIGHBORS) || (l3_header->proto == L3_PROTO_FCMP)){
+		return 0;
+	}
+	source = fcmp_source_of(l3_header->src, now);
+	if(!token_bucket_take(&source->bucket, fcmp_src_rate, fcmp_src_burst, now)){
+		source->suppressed++;
+		my_fcmp_limiter.suppressed_source[kind]++;
+		return 0;
+	}
+	if(!token_bucket_take(&my_fcmp_limiter.global, fcmp_rate, fcmp_burst, now)){
+		source->suppressed++;
+		my_fcmp_limiter.suppressed_global[kind]++;
+		return 0;
+	}
+	source->sent++;
+	my_fcmp_limiter.sent[kind]++;
+	fish_fcmp.send_fcmp_response(l3frame, len, error);
+	return 1;
+}
+
+void print_my_fcmp_limiter(){
+	const char *kinds[FCMP_KINDS] = {"Other", "TTL exceeded", "Net unreachable", "Host unreachable"};
+	int i = 0;
+	fprintf(stdout, "\n"
+		"                      FCMP RATE LIMITS                     \n"
+		" ========================================================= \n");
+	fprintf(stdout, " Per source: %d/s, burst %d    Global: %d/s, burst %d    (0/s is unlimited)\n",
+		fcmp_src_rate, fcmp_src_burst, fcmp_rate, fcmp_burst);
+	fprintf(stdout, " Error                   Sent   Suppressed (source)   Suppressed (global)\n"
+		" -----------------    -------   -------------------   -------------------\n");
+	for(; i < FCMP_KINDS; i++){
+		fprintf(stdout, " %-17s    %7lu   %19lu   %19lu\n", kinds[i],
+			my_fcmp_limiter.sent[i],
+			my_fcmp_limiter.suppressed_source[i],
+			my_fcmp_limiter.suppressed_global[i]);
+	}
+	fprintf(stdout, "\n     Source              Sent   Suppressed\n"
+		" ----------------    -------   ----------\n");
+	for(i = 0; i < FCMP_SOURCES; i++){
+		if(my_fcmp_limiter.sources[i].valid && my_fcmp_limiter.sources[i].suppressed){
+			fprintf(stdout, " %16s    %7lu   %10lu\n", fn_ntoa(my_fcmp_limiter.sources[i].src),
+				my_fcmp_limiter.sources[i].sent, my_fcmp_limiter.sources[i].suppressed);
+		}
+	}
+}
+
+/* ========================================================= */
+/* ================= L3 Protocol Dispatch ================== */
+/* ========================================================= */
+/* frames for us go to a handler picked by proto, one slot per value of the
+ * byte. A protocol we run ourselves registers here and returns L3_CONSUMED
+ * once it is done with a frame, so libfish's l4 never sees it. Anything
+ * without a handler, or whose handler returns L3_PASS, goes up to l4
+ */
+struct l3_dispatch my_l3_dispatch;
+
+void l3_register_handler(uint8_t proto, l3_proto_handler handler){
+	my_l3_dispatch.handlers[proto] = handler;
+}
+
+int l3_handle_dv(void *l4frame, int len, fnaddr_t src){
+	process_dv_packet(l4frame, src, len);
+	return L3_CONSUMED;
+}
+
+int l3_handle_neigh(void *l4frame, int len, fnaddr_t src){
+	process_neighbor_packet(l4frame, src, len);
+	return L3_CONSUMED;
+}
+
+void print_my_l3_dispatch(){
+	int i = 0;
+	fprintf(stdout, "\n"
+		"                    L3 PROTOCOL DISPATCH                   \n"
+		" ========================================================= \n"
+		" Proto   Handler     Delivered    Consumed\n"
+		" -----   -------   -----------  ----------\n");
+	for(; i < L3_PROTOS; i++){
+		if(my_l3_dispatch.handlers[i] || my_l3_dispatch.delivered[i]){
+			fprintf(stdout, " %5d   %7s   %11lu  %10lu\n", i, my_l3_dispatch.handlers[i] ? "yes" : "l4",
+				my_l3_dispatch.delivered[i], my_l3_dispatch.consumed[i]);
+		}
+	}
+}
 
 /* ========================================================= */
 /* =================== Basic Implementation ================ */
 /*========================================================== */
+/* the proto's handler first, then up to l4 unless the handler consumed it */
+int l3_deliver_local(void *l3frame, int len){
+	struct fishnet_l3_header *l3_header = (struct fishnet_l3_header *)l3frame;
+	void *l4frame = l3_header + 1; //just past the l3 header
+	l3_proto_handler handler = my_l3_dispatch.handlers[l3_header->proto];
+	
+	my_l3_dispatch.delivered[l3_header->proto]++;
+	if((handler != NULL) && (handler(l4frame, len - L3_HEADER_LENGTH, l3_header->src) == L3_CONSUMED)){
+		my_l3_dispatch.consumed[l3_header->proto]++;
+		return 1;
+	}
+	//fprintf(stderr, "Sending this packet to lvl4 of this fishnode!\n");
+	return fish_l4.fish_l4_receive(l4frame, len - L3_HEADER_LENGTH, l3_header->proto, l3_header->src); 
+}
+
 int my_fishnode_l3_receive(void *l3frame, int len){
 	int ret = 1;
 
 	struct fishnet_l3_header *l3_header = (struct fishnet_l3_header *)l3frame;
-	uint8_t proto  = l3_header->proto;
-	fnaddr_t src   = l3_header->src;
 	
 	if(l3_header->src == ALL_NEIGHBORS){
 		return 0;
 	}
-	
-	
-	/* If l3 dest is node's l3 addr, remove l3 header and pass to l4 code */
-	if(l3_header->dest == fish_getaddress()){
-		//fprintf(stderr, "This packet is meant for me!\n");
-		//fish_debugframe(FISH_DEBUG_ALL, "FOR ME!!!", l3frame, 3, len, L3_PROTO_DV);
-		
-		/* check if dv packet */
-		if(l3_header->proto == L3_PROTO_DV){
-			l3_header++; //move pointer to l3 header along to point to l4frame
-			process_dv_packet(l3_header, src, len - L3_HEADER_LENGTH);	
-			l3_header--;
-		}
-		else if(l3_header->proto == L3_PROTO_NEIGH){
-			l3_header++; //move pointer to l3 header along to point to l4frame
-			process_neighbor_packet(l3_header, src, len - L3_HEADER_LENGTH);	
-			l3_header--;
-		}	
-		l3_header++; //move pointer to l3 header along
-		
-		//fprintf(stderr, "Sending this packet to lvl4 of this fishnode!\n");
-		return fish_l4.fish_l4_receive(l3_header, len - L3_HEADER_LENGTH, proto, src); 
+	if(rx_batch){
+		return rx_batch_add(l3frame, len);
+	}
+	neighbor_heard(l3_header->src, l3_header->proto, l3_header->ttl);
+	
+	
+	/* If l3 dest is node's l3 addr, remove l3 header and pass to l4 code */
+	if(l3_header->dest == fish_getaddress()){
+		//fprintf(stderr, "This packet is meant for me!\n");
+		//fish_debugframe(FISH_DEBUG_ALL, "FOR ME!!!", l3frame, 3, len, L3_PROTO_DV);
+		return l3_deliver_local(l3frame, len);
+	}
+	
+	/* if l3 dest is broadcast ... */
+	else if(l3_header->dest == ALL_NEIGHBORS){
+		//fprintf(stderr, "Dest is Broadcast. Checking if received by node previously... ");
+		/* and received by node previously, drop with no FCMP message */
+		
+		if(!received_previously(l3_header->src, l3_header->id)){
+			/* only the copy that came over our way back to the source counts. Any
+			 * other is dropped before it is marked seen, so it can't shadow that one
+			 */
+			if((l3_header->ttl > 1) && !rpf_accept(l3_header->src, my_l2.from_valid ? &my_l2.from : NULL)){
+				return 0;
+			}
+			/* add packet ID as seen already! */
+			//fprintf(stderr, "NOPE\n");
+			add_id_seen(l3_header->id, l3_header->src);
+
+			//fish_debugframe(7, "Received packet", l3frame, 3, len, 9);
+			ret = l3_deliver_local(l3frame, len); //pass up network stack
+			
+			/* a link local broadcast ends here, there is nobody to tell */
+			if(l3_header->ttl <= 1){
+				return ret;
+			}
+			l3_header->ttl -= 1; //decrement ttl
+			
+			ret &= fish_l3.fish_l3_forward(l3frame, len); //forward back over fishnet
+		}
+		else{
+			return 0;
+		}
+	}
+	else{
+		l3_header->ttl -= 1;
+		if(fwd_pipeline_take(l3frame, len)){
+			return 1;
+		}
+		return fish_l3.fish_l3_forward(l3frame, len);
+	}	
+	return ret;
+}
+
+/* ========================================================= */
+/* ====================== Buffer Pool ====================== */
+/* ========================================================= */
+/* MTU sized buffers carved out of slabs that are never given back, so after
+ * warm up a send costs two list operations instead of a malloc and a free.
+ * The slabs sit back to back in one reserved arena, which keeps finding the
+ * buffer behind any pointer O(1). Past POOL_MAX_SLABS pool_get returns NULL
+ * and whoever asked drops the frame.
+ *
+ * Buffers are reference counted. Whoever creates a frame holds one reference
+ * and drops it when its send returns (fish.h: the caller frees). A layer that
+ * needs the frame after returning, like a queue waiting on ARP, takes its own
+ * with frame_hold() and drops it with frame_release() when it is done
+ */
+struct buf_pool my_pool;
+pthread_mutex_t my_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread struct pool_cache my_pool_cache;
+
+/* called with the lock held, returns 0 once every slab is carved out */
+int pool_grow(){
+	uint8_t *slab = NULL;
+	struct pool_buf *buf = NULL;
+	int i = 0;
+	if(my_pool.num_slabs >= POOL_MAX_SLABS){
+		return 0;
+	}
+	if(my_pool.arena == NULL){
+		//only address space, pages get backed as slabs are carved from it
+		slab = mmap(NULL, POOL_ARENA_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+		if(slab == MAP_FAILED){
+			exit(3501);
+		}
+		__sync_synchronize();
+		my_pool.arena = slab;
+	}
+	slab = my_pool.arena + (size_t)my_pool.num_slabs * POOL_SLAB_BYTES;
+	my_pool.num_slabs++;
+	for(; i < POOL_SLAB_BUFS; i++){
+		buf = (struct pool_buf *)(slab + i * POOL_BUF_SIZE);
+		buf->next = my_pool.free;
+		my_pool.free = buf;
+	}
+	my_pool.num_free += POOL_SLAB_BUFS;
+	return 1;
+}
+
+/* moves up to count buffers from the shared list into this thread's cache */
+void pool_refill(int count){
+	struct pool_buf *buf = NULL;
+	pthread_mutex_lock(&my_pool_lock);
+	for(; count > 0; count--){
+		if((my_pool.free == NULL) && !pool_grow()){
+			break;
+		}
+		buf = my_pool.free;
+		my_pool.free = buf->next;
+		my_pool.num_free--;
+		buf->next = my_pool_cache.free;
+		my_pool_cache.free = buf;
+		my_pool_cache.count++;
+	}
+	pthread_mutex_unlock(&my_pool_lock);
+}
+
+/* hands count buffers from this thread's cache back to the shared list */
+void pool_drain(int count){
+	struct pool_buf *buf = NULL;
+	pthread_mutex_lock(&my_pool_lock);
+	for(; (count > 0) && (my_pool_cache.free != NULL); count--){
+		buf = my_pool_cache.free;
+		my_pool_cache.free = buf->next;
+		my_pool_cache.count--;
+		buf->next = my_pool.free;
+		my_pool.free = buf;
+		my_pool.num_free++;
+	}
+	pthread_mutex_unlock(&my_pool_lock);
+}
+
+/* returns the frame area of a fresh buffer, holding its only reference,
+ * or NULL when the pool is at POOL_MAX_SLABS and nothing is free
+ */
+void *pool_get(){
+	struct pool_buf *buf = NULL;
+	int in_use = 0, high_water = 0;
+	if(my_pool_cache.free == NULL){
+		pool_refill(POOL_CACHE_MAX / 2);
+	}
+	if(my_pool_cache.free == NULL){
+		__sync_fetch_and_add(&my_pool.exhausted, 1);
+		return NULL;
+	}
+	buf = my_pool_cache.free;
+	my_pool_cache.free = buf->next;
+	my_pool_cache.count--;
+	buf->refcnt = 1;
+	
+	in_use = __sync_add_and_fetch(&my_pool.in_use, 1);
+	__sync_fetch_and_add(&my_pool.gets, 1);
+	//racy read is fine, the swap only succeeds if it still holds
+	while(in_use > (high_water = my_pool.high_water)){
+		if(__sync_bool_compare_and_swap(&my_pool.high_water, high_water, in_use)){
+			break;
+		}
+	}
+	return buf + 1;
+}
+
+void pool_put(struct pool_buf *freed){
+	freed->next = my_pool_cache.free;
+	my_pool_cache.free = freed;
+	my_pool_cache.count++;
+	__sync_sub_and_fetch(&my_pool.in_use, 1);
+	if(my_pool_cache.count > POOL_CACHE_MAX){
+		pool_drain(POOL_CACHE_MAX / 2);
+	}
+}
+
+/* the pool buffer a pointer falls in, NULL if it isn't ours (libfish's frames) */
+struct pool_buf *pool_buf_of(const void *frame){
+	const uint8_t *p = frame;
+	uint8_t *arena = my_pool.arena;
+	if((arena == NULL) || (p < arena) || (p >= arena + POOL_ARENA_BYTES)){
+		return NULL;
+	}
+	return (struct pool_buf *)(arena + ((size_t)(p - arena) / POOL_BUF_SIZE) * POOL_BUF_SIZE);
+}
+
+/* keeps a frame past the call that handed it over. Our own frames just gain a
+ * reference, anyone else's gets copied into a pool buffer. Either way release
+ * the returned pointer with frame_release(). NULL if it is too big to copy or
+ * the pool is exhausted, the caller drops it
+ */
+void *frame_hold(void *frame, int len){
+	struct pool_buf *buf = pool_buf_of(frame);
+	void *copy = NULL;
+	if(buf != NULL){
+		__sync_fetch_and_add(&buf->refcnt, 1);
+		__sync_fetch_and_add(&my_pool.holds, 1);
+		return frame;
+	}
+	if(len > POOL_BUF_DATA - L2_HEADER_LENGTH){
+		return NULL;
+	}
+	//copied in behind room for an L2 header, so sending it on needs no second copy
+	copy = pool_get();
+	if(copy == NULL){
+		return NULL;
 	}
-	
-	/* if l3 dest is broadcast ... */
-	else if(l3_header->dest == ALL_NEIGHBORS){
-		//fprintf(stderr, "Dest is Broadcast. Checking if received by node previously... ");
-		/* and received by node previously, drop with no FCMP message */
-		
-		if(!received_previously(l3_header->src, l3_header->id)){
-			/* add packet ID as seen already! */
-			//fprintf(stderr, "NOPE\n");
-			add_id_seen(l3_header->id, l3_header->src);
+	copy = (uint8_t *)copy + L2_HEADER_LENGTH;
+	memcpy(copy, frame, len);
+	__sync_fetch_and_add(&my_pool.hold_copies, 1);
+	return copy;
+}
 
-			//fish_debugframe(7, "Received packet", l3frame, 3, len, 9);
-			if(l3_header->proto == L3_PROTO_DV){
-				l3_header++; //move pointer to l3 header along
-				//fprintf(stderr, "Received a DV packet broadcast to all nodes\n");
-				process_dv_packet(l3_header, src, len - L3_HEADER_LENGTH);	
-				l3_header--;
-			}	
-			else if(l3_header->proto == L3_PROTO_NEIGH){
-				l3_header++; //move pointer to l3 header along to point to l4frame
-				process_neighbor_packet(l3_header, src, len - L3_HEADER_LENGTH);	
-				l3_header--;
-			}	
-			
-			l3_header++; //move pointer to l3 header along
-			ret = fish_l4.fish_l4_receive(l3_header, len - L3_HEADER_LENGTH, proto, src); //pass up network stack
-			l3_header--; //move pointer back to original position
-			
-			l3_header->ttl -= 1; //decrement ttl
-			
-			ret &= fish_l3.fish_l3_forward(l3frame, len); //forward back over fishnet
-		}
-		else{
-			return 0;
+void frame_release(void *frame){
+	struct pool_buf *buf = pool_buf_of(frame);
+	assert(buf != NULL);
+	if(__sync_sub_and_fetch(&buf->refcnt, 1) == 0){
+		pool_put(buf);
+	}
+}
+
+void print_my_pool(){
+	fprintf(stdout, "\n"
+		"                        BUFFER POOL                        \n"
+		" ========================================================= \n");
+	fprintf(stdout, " Buffers:       %d x %d bytes in %d slabs\n", my_pool.num_slabs * POOL_SLAB_BUFS, POOL_BUF_SIZE, my_pool.num_slabs);
+	fprintf(stdout, " In use:        %d\n", my_pool.in_use);
+	fprintf(stdout, " High water:    %d\n", my_pool.high_water);
+	fprintf(stdout, " Shared free:   %d\n", my_pool.num_free);
+	fprintf(stdout, " Cached here:   %d\n", my_pool_cache.count);
+	fprintf(stdout, " Allocations:   %lu (%lu too big or past the cap, from the heap)\n", my_pool.gets, my_pool.heap_fallbacks);
+	fprintf(stdout, " Holds:         %lu references, %lu copies of foreign frames\n", my_pool.holds, my_pool.hold_copies);
+	fprintf(stdout, " Exhausted:     %lu gets refused at %d slabs\n", my_pool.exhausted, POOL_MAX_SLABS);
+}
+
+/* ========================================================= */
+/* ===================== Packet Buffers ==================== */
+/* ========================================================= */
+/* allocates room for len bytes of payload plus headroom, returns the payload.
+ * Our own packets fall back to the heap when the pool is exhausted
+ */
+void *pkt_init(struct pkt_buf *pkt, int len){
+	pkt->head = NULL;
+	if(PKT_HEADROOM + len <= POOL_BUF_DATA){
+		pkt->head  = pool_get();
+		pkt->owned = PKT_POOL;
+	}
+	if(pkt->head == NULL){
+		pkt->head  = malloc(PKT_HEADROOM + len);
+		pkt->owned = PKT_HEAP;
+		__sync_fetch_and_add(&my_pool.heap_fallbacks, 1);
+		if(pkt->head == NULL){
+			exit(3435);
 		}
 	}
-	else{
-		l3_header->ttl -= 1;
-		return fish_l3.fish_l3_forward(l3frame, len);
-	}	
-	return ret;
+	pkt->data  = pkt->head + PKT_HEADROOM;
+	pkt->len   = len;
+	return pkt->data;
 }
 
-int my_fish_l3_send(void *l4frame, int len, fnaddr_t dst_addr, uint8_t proto, uint8_t ttl){
-	int ret = 1;
-	
-	void *l3frame = malloc(sizeof(struct fishnet_l3_header) + len);
-	if(l3frame == NULL){
-		//fprintf(stderr, "Failed to malloc for function: my_fish_l3_send\n");
-		exit(3434);
+/* describes a payload the caller built with PKT_HEADROOM in front of it */
+void pkt_wrap(struct pkt_buf *pkt, void *payload, int len){
+	pkt->head  = (uint8_t *)payload - PKT_HEADROOM;
+	pkt->data  = payload;
+	pkt->len   = len;
+	pkt->owned = PKT_WRAPPED;
+}
+
+/* claims header_len bytes of headroom, returns where the header goes */
+void *pkt_push(struct pkt_buf *pkt, int header_len){
+	assert(pkt->data - header_len >= pkt->head);
+	pkt->data -= header_len;
+	pkt->len  += header_len;
+	return pkt->data;
+}
+
+/* the frame is ours again once the send returns, see fish.h */
+void pkt_release(struct pkt_buf *pkt){
+	if(pkt->owned == PKT_POOL){
+		frame_release(pkt->head); //anyone still holding it keeps it alive
 	}
-	
-	l3frame += L3_HEADER_LENGTH; //move the pointer to start of l3 header
-	memcpy(l3frame, l4frame, len);
- 	l3frame -= L3_HEADER_LENGTH; //move back to the original spot
-	
-        struct fishnet_l3_header *l3_header = (struct fishnet_l3_header *)l3frame;	
+	else if(pkt->owned == PKT_HEAP){
+		free(pkt->head);
+	}
+	pkt->head = pkt->data = NULL;
+}
+
+/* writes the l3 header in place and hands the frame to forwarding */
+int l3_send_pkt(struct pkt_buf *pkt, fnaddr_t dst_addr, uint8_t proto, uint8_t ttl){
+	int len = pkt->len;
+        struct fishnet_l3_header *l3_header = pkt_push(pkt, L3_HEADER_LENGTH);
 	
 	if((ttl >= MAX_TTL) || (ttl == 0)){
 		//fprintf(stderr, "setting ttl to MAX_TTL CAUSEOF THIS THING\n");
@@ -813,7 +3565,19 @@ int my_fish_l3_send(void *l4frame, int len, fnaddr_t dst_addr, uint8_t proto, ui
 	add_id_seen(l3_header->id, fish_getaddress());
 
 	fish_debugframe(FISH_DEBUG_ALL, "Sending this packet", l3_header, 3, len + L3_HEADER_LENGTH, 5);
-	ret = fish_l3.fish_l3_forward(l3frame, len + L3_HEADER_LENGTH);	
+	return fish_l3.fish_l3_forward(pkt->data, pkt->len);	
+}
+
+/* libfish's l4 code hands us payloads without headroom, those get one copy.
+ * Our own senders build into a pkt_buf and call l3_send_pkt directly
+ */
+int my_fish_l3_send(void *l4frame, int len, fnaddr_t dst_addr, uint8_t proto, uint8_t ttl){
+	int ret = 1;
+	struct pkt_buf pkt;
+	
+	memcpy(pkt_init(&pkt, len), l4frame, len);
+	ret = l3_send_pkt(&pkt, dst_addr, proto, ttl);
+	pkt_release(&pkt);
 	return ret;
 }
 
@@ -836,7 +3600,7 @@ int my_fish_l3_forward(void *l3frame, int len){
 	//fish_debugframe(7, "TEMP THING", l3frame, 3, len, 9);
 	/* if TTL is 0 and the dest is not local, drop packet and generate FCMP error message */
 	if((l3_header->ttl == 0) && !is_local(l3_header->dest)){
-		fish_fcmp.send_fcmp_response(l3frame, len, FCMP_TTL_EXCEEDED);
+		fcmp_error(l3frame, len, FCMP_TTL_EXCEEDED);
 		return 0;	
 	}	
 	
@@ -849,19 +3613,22 @@ int my_fish_l3_forward(void *l3frame, int len){
 		//fprintf(stderr, "Looking for best match in forwarding table for: %s\n", fn_ntoa(l3_header->dest)); 
 		next_hop = fish_fwd.longest_prefix_match(l3_header->dest);
 	}
+	ret = l3_forward_to(l3frame, len, next_hop);
+	return ret;
+}
+
+/* second half of forwarding, once the next hop is known (0 when there is no route) */
+int l3_forward_to(void *l3frame, int len, fnaddr_t next_hop){
 	/* if there is no route to the destination, drop the frame and generate correct FCMP error message */
 	if(next_hop == 0){
 		//fprintf(stderr, "No route to the destination. Dropping Frame!\n");
-		fish_fcmp.send_fcmp_response(l3frame, len, FCMP_NET_UNREACHABLE);
+		fcmp_error(l3frame, len, FCMP_NET_UNREACHABLE);
 		return 0;
 
 	}
 	/* use fish_l2_send to send the frame to the next-hop neighbor indicated by the forwarding table */
 	//fprintf(stderr, "Sending the packet to hop %s with length %d\n", fn_ntoa(next_hop), len);
-	ret = fish_l2.fish_l2_send(l3frame, next_hop, len); 
-
-	/* do we need to add the frame to the routing table here too? */
-	return ret;
+	return nh_queue_send(l3frame, len, next_hop);
 }
 
 /* ========================================================= */
@@ -874,6 +3641,7 @@ void *my_add_fwtable_entry(fnaddr_t dst,
                            char type,
                            void *user_data){
 	//fprintf(stderr, "Adding to the table if it exists!\n");
+	pthread_rwlock_wrlock(&my_fwd_lock);
 	
 	/* check to see if we need to make the table bigger */
 	if(num_forwarding_table_entries >= my_forwarding_table_size){
@@ -895,8 +3663,15 @@ void *my_add_fwtable_entry(fnaddr_t dst,
 	my_forwarding_table[j].user_data     = user_data; //place in dv table!!!!
 	my_forwarding_table[j].valid         = 1;
 	my_forwarding_table[j].is_best       = '>'; //temporary, not everything should be the best!
+	my_forwarding_table[j].alt_next_hop  = 0;
+	my_forwarding_table[j].alt_metric    = 0;
+	link_next_hop(j);
 
 	num_forwarding_table_entries++;
+	pthread_rwlock_unlock(&my_fwd_lock);
+	
+	/* so the first frame down the new route doesn't wait on ARP */
+	arp_prefetch(next_hop);
 	
 	/* return the pointer to the entry */
 	return (void *)&my_forwarding_table[j];
@@ -908,7 +3683,10 @@ void *my_remove_fwtable_entry(void *route_key){
 	 */
 	//fprintf(stderr, "Removing an entry from the forwarding table!\n");
 	/* this is definitely not going to work! */
+	pthread_rwlock_wrlock(&my_fwd_lock);
 	((struct forwarding_table_entry *)(route_key))->valid = 0; 	//mark as invalid
+	unlink_next_hop((struct forwarding_table_entry *)(route_key) - my_forwarding_table);
+	pthread_rwlock_unlock(&my_fwd_lock);
 	
 	num_forwarding_table_entries--;		//decrement the number of entries in the table
 	return ((struct forwarding_table_entry *)(route_key))->user_data;//return the user data stored for this entry
@@ -921,7 +3699,9 @@ int my_update_fwtable_metric(void *route_key, int new_metric){
 		return 0;
 	}
 	/* this is definitely not going to work! */
+	pthread_rwlock_wrlock(&my_fwd_lock);
 	((struct forwarding_table_entry *)(route_key))->metric = new_metric;
+	pthread_rwlock_unlock(&my_fwd_lock);
 
 	return update_successful;
 }
@@ -929,40 +3709,644 @@ int my_update_fwtable_metric(void *route_key, int new_metric){
 /* return the best next hop for the proposed address */
 fnaddr_t my_longest_prefix_match(fnaddr_t addr){
 	fnaddr_t best_match = (fnaddr_t)htonl(0);
-	int i = 0, best_match_length = 0, match_length = 0;
-	int best_metric = MAX_TTL;
+	lpm_batch(&addr, &best_match, 1);
+	//fprintf(stderr, "\n================================================\n");
+	//fprintf(stderr, "Longest Match resolves to next hop: %s", fn_ntoa(best_match));
+	//fprintf(stderr, "\n================================================\n\n");
+	return best_match;
+}
+
+/* longest prefix match for a whole batch of addresses in one pass over the table */
+void lpm_batch(fnaddr_t *addrs, fnaddr_t *best_matches, int count){
+	int best_match_length[RX_BATCH_MAX], best_metric[RX_BATCH_MAX];
+	int i = 0, j = 0, match_length = 0;
 	uint32_t mask = 0;
 	
+	for(j = 0; j < count; j++){
+		best_matches[j]      = (fnaddr_t)htonl(0);
+		best_match_length[j] = 0;
+		best_metric[j]       = MAX_TTL;
+	}
 	for(; i < my_forwarding_table_size; i++){
-		if(my_forwarding_table[i].valid){
-			/* DOES THE MASK HAVE TO BE IN NETWORK ORDER OR WHAT???? */
-			mask = ~((1 << (my_forwarding_table[i].prefix_length)) - 1);
-			//fprintf(stderr, "Checking entry %d in the table\n", i);
-			//fprintf(stderr, "\tMatching: %s to\n", fn_ntoa(my_forwarding_table[i].dest));
-			//fprintf(stderr, "\tEntry   : %s\n", fn_ntoa(addr));
-			//fprintf(stderr, "\tNetmask : %s\n"
-			//		"\tmask    : %d\n",
-			//		fn_ntoa(ntohl(mask)),
-			//		my_forwarding_table[i].prefix_length);
-			//sleep(1);//temp addition to watch
+		if(!my_forwarding_table[i].valid){
+			continue;
+		}
+		/* mask is built in host order, flipped to network order below */
+		mask = htonl(prefix_length_to_mask(my_forwarding_table[i].prefix_length));
+		match_length = my_forwarding_table[i].prefix_length;
+		for(j = 0; j < count; j++){
 			/* mask off host bits of addr to compare to table entry */
-			if((htonl(mask) & (uint32_t)addr) == (uint32_t)my_forwarding_table[i].dest){
-				//fprintf(stderr, "Found a match of %d long!!!!!!\n\n", my_forwarding_table[i].prefix_length);
-				match_length = my_forwarding_table[i].prefix_length;
-				if(match_length >= best_match_length && (my_forwarding_table[i].metric < best_metric)){
-					//fprintf(stderr, "\n\t\tFound a new best next hop %s!\n\n", fn_ntoa(my_forwarding_table[i].next_hop));
-					best_metric = my_forwarding_table[i].metric;
-					best_match = my_forwarding_table[i].next_hop;
-					best_match_length = match_length;
-				}	
+			if((mask & (uint32_t)addrs[j]) != (uint32_t)my_forwarding_table[i].dest){
+				continue;
 			}
-					
+			/* longer prefixes always win, the metric only breaks ties between equal lengths */
+			if((match_length > best_match_length[j]) || 
+			   ((match_length == best_match_length[j]) && (my_forwarding_table[i].metric < best_metric[j]))){
+				best_metric[j]       = my_forwarding_table[i].metric;
+				best_matches[j]      = my_forwarding_table[i].next_hop;
+				best_match_length[j] = match_length;
+			}	
 		}
 	}
-	//fprintf(stderr, "\n================================================\n");
-	//fprintf(stderr, "Longest Match resolves to next hop: %s", fn_ntoa(best_match));
-	//fprintf(stderr, "\n================================================\n\n");
-	return best_match;
+}
+
+/* ========================================================= */
+/* ================ Reverse Path Broadcast ================= */
+/* ========================================================= */
+/* a new broadcast is only flooded on if it came from the neighbor our own
+ * route back to its source goes through. Every node then sends each
+ * broadcast once, along the tree of best routes towards the source, instead
+ * of every copy from every neighbor until the dedupe table stops it. Other
+ * copies are dropped without being marked seen, so whichever order they
+ * arrive in, the one over the reverse path still gets delivered and flooded.
+ * While we can't tell (no route yet, or no L2 address for the next hop) it
+ * floods like before and the dedupe table still catches the repeats
+ */
+struct rpf_state my_rpf;
+
+int rpf_accept(fnaddr_t src, const fn_l2addr_t *from){
+	fnaddr_t next_hop = 0;
+	int i = 0;
+	if(!bcast_rpf){
+		return 1;
+	}
+	if(from != NULL){
+		next_hop = fish_fwd.longest_prefix_match(src);
+	}
+	if((next_hop == 0) || (next_hop == ALL_NEIGHBORS) || (next_hop == fish_getaddress()) ||
+	   ((i = arp_find(next_hop)) < 0) || !my_arp.entries[i].resolved){
+		my_rpf.unknown++;
+		return 1;
+	}
+	if(FNL2_EQ(my_arp.entries[i].l2addr, *from)){
+		my_rpf.flooded++;
+		return 1;
+	}
+	my_rpf.suppressed++;
+	return 0;
+}
+
+void print_my_rpf(){
+	fprintf(stdout, "Reverse path check is %s\n", bcast_rpf ? "on" : "off");
+	fprintf(stdout, "%lu broadcasts flooded on, %lu dropped off the reverse path, %lu flooded unchecked\n",
+		my_rpf.flooded, my_rpf.suppressed, my_rpf.unknown);
+}
+
+/* ========================================================= */
+/* ===================== Receive Batching ================== */
+/* ========================================================= */
+/* with rx_batch on, frames are only held as they come in. Once the event loop
+ * comes around (or the batch fills up) the whole batch goes through each
+ * stage together: classify, deliver locally, then one forwarding table pass
+ * for every frame that moves on. Local delivery runs first so routing
+ * updates in the batch are already in place for the lookups
+ */
+struct rx_batch_state my_rx_batch;
+
+void rx_batch_flush(){
+	struct rx_frame frames[RX_BATCH_MAX];
+	struct fishnet_l3_header *l3_header = NULL;
+	fnaddr_t dests[RX_BATCH_MAX], next_hops[RX_BATCH_MAX];
+	int lookup[RX_BATCH_MAX];
+	int count = my_rx_batch.count, num_lookups = 0, i = 0;
+	
+	//anything that shows up while we work starts a new batch
+	memcpy(frames, my_rx_batch.frames, count * sizeof(struct rx_frame));
+	my_rx_batch.count = 0;
+	my_rx_batch.scheduled = 0;
+	my_rx_batch.batches++;
+	if(count > my_rx_batch.largest){
+		my_rx_batch.largest = count;
+	}
+	
+	/* classify: liveness, dedupe and where each frame goes */
+	for(i = 0; i < count; i++){
+		if(i + 1 < count){
+			__builtin_prefetch(frames[i + 1].l3frame);
+		}
+		l3_header = frames[i].l3frame;
+		frames[i].local = frames[i].forward = 0;
+		neighbor_heard(l3_header->src, l3_header->proto, l3_header->ttl);
+		if(l3_header->dest == fish_getaddress()){
+			frames[i].local = 1;
+		}
+		else if(l3_header->dest == ALL_NEIGHBORS){
+			//off the reverse path copies are dropped unseen, same as one at a time
+			if(!received_previously(l3_header->src, l3_header->id) &&
+			   ((l3_header->ttl <= 1) || rpf_accept(l3_header->src, frames[i].from_valid ? &frames[i].from : NULL))){
+				add_id_seen(l3_header->id, l3_header->src);
+				frames[i].local   = 1;
+				frames[i].forward = (l3_header->ttl > 1); //a link local one ends here
+			}
+		}
+		else{
+			frames[i].forward = 1;
+		}
+	}
+	
+	/* deliver */
+	for(i = 0; i < count; i++){
+		if(frames[i].local){
+			l3_deliver_local(frames[i].l3frame, frames[i].len);
+		}
+	}
+	
+	/* ttl, then collect what needs a lookup */
+	for(i = 0; i < count; i++){
+		if(!frames[i].forward){
+			continue;
+		}
+		l3_header = frames[i].l3frame;
+		l3_header->ttl -= 1;
+		if(fish_l3.fish_l3_forward != my_fish_l3_forward){
+			//someone else forwards, hand it over whole
+			fish_l3.fish_l3_forward(frames[i].l3frame, frames[i].len);
+			frames[i].forward = 0;
+		}
+		else if(l3_header->ttl == 0){
+			fcmp_error(frames[i].l3frame, frames[i].len, FCMP_TTL_EXCEEDED);
+			frames[i].forward = 0;
+		}
+		else if(l3_header->dest == ALL_NEIGHBORS){
+			frames[i].next_hop = ALL_NEIGHBORS;
+		}
+		else if(fwd_pipeline_take(frames[i].l3frame, frames[i].len)){
+			frames[i].forward = 0; //a worker has it now
+		}
+		else{
+			dests[num_lookups]  = l3_header->dest;
+			lookup[num_lookups] = i;
+			num_lookups++;
+		}
+	}
+	
+	/* one table pass for the lot */
+	if(fish_fwd.longest_prefix_match == my_longest_prefix_match){
+		lpm_batch(dests, next_hops, num_lookups);
+	}
+	else{
+		for(i = 0; i < num_lookups; i++){
+			next_hops[i] = fish_fwd.longest_prefix_match(dests[i]);
+		}
+	}
+	for(i = 0; i < num_lookups; i++){
+		frames[lookup[i]].next_hop = next_hops[i];
+	}
+	
+	/* transmit and let go */
+	for(i = 0; i < count; i++){
+		if(frames[i].forward){
+			l3_forward_to(frames[i].l3frame, frames[i].len, frames[i].next_hop);
+		}
+		frame_release(frames[i].l3frame);
+	}
+}
+
+/* holds the frame (it belongs to libfish) until the batch runs */
+int rx_batch_add(void *l3frame, int len){
+	void *held = frame_hold(l3frame, len);
+	if(held == NULL){
+		my_rx_batch.dropped++; //bigger than an MTU, or the pool is exhausted
+		return 0;
+	}
+	my_rx_batch.frames[my_rx_batch.count].l3frame = held;
+	my_rx_batch.frames[my_rx_batch.count].len     = len;
+	//the L2 header doesn't come along, keep its sender for the broadcast check
+	my_rx_batch.frames[my_rx_batch.count].from       = my_l2.from;
+	my_rx_batch.frames[my_rx_batch.count].from_valid = my_l2.from_valid;
+	my_rx_batch.count++;
+	my_rx_batch.frames_total++;
+	
+	if(my_rx_batch.count >= rx_batch_size){
+		rx_batch_flush();
+	}
+	else if(!my_rx_batch.scheduled){
+		my_rx_batch.scheduled = 1;
+		fish_scheduleevent(0, rx_batch_flush, 0);
+	}
+	return 1;
+}
+
+void print_my_rx_batch(){
+	fprintf(stdout, "Receive batching %s, up to %d frames\n", rx_batch ? "on" : "off", rx_batch_size);
+	fprintf(stdout, "%lu frames in %lu batches, largest %d, %lu dropped without a buffer\n", my_rx_batch.frames_total, my_rx_batch.batches, my_rx_batch.largest, my_rx_batch.dropped);
+}
+
+/* ========================================================= */
+/* ================== Forwarding Pipeline ================== */
+/* ========================================================= */
+/* with fwd_workers set, transit frames are looked up off the event loop.
+ * The event loop holds each frame and hands it to a worker over a ring; the
+ * worker does the forwarding table lookup (a burst at a time, under the read
+ * lock) and passes it back over a second ring. libfish isn't thread safe, so
+ * sending, FCMP errors, routing and everything else stay on the main thread.
+ * A worker nudges the event loop through a pipe that fish_readhook watches.
+ *
+ * Frames are steered by a hash of src, dest and proto. Rings are FIFO and
+ * the main thread sends a worker's returns in order, so a flow that stays on
+ * one worker is never reordered
+ */
+struct fwd_pipeline my_fwd_pipeline = { .notify_fds = {-1, -1} };
+
+void spsc_init(struct spsc_ring *ring, int size){
+	ring->slots = calloc(size, sizeof(struct fwd_job));
+	if(ring->slots == NULL){
+		exit(3901);
+	}
+	ring->mask = size - 1;
+	ring->head = ring->tail = 0;
+}
+
+/* producer side, 0 if the ring is full */
+int spsc_push(struct spsc_ring *ring, struct fwd_job *job){
+	unsigned int head = ring->head;
+	if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask){
+		return 0;
+	}
+	ring->slots[head & ring->mask] = *job;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE); //job is written before it shows up
+	return 1;
+}
+
+/* consumer side, 0 if the ring is empty */
+int spsc_pop(struct spsc_ring *ring, struct fwd_job *job){
+	unsigned int tail = ring->tail;
+	if(tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)){
+		return 0;
+	}
+	*job = ring->slots[tail & ring->mask];
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE); //slot is free again
+	return 1;
+}
+
+int spsc_depth(struct spsc_ring *ring){
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/* called by a worker after it returns frames. One byte per wakeup is enough,
+ * the event loop empties every ring when it comes around
+ */
+void fwd_notify_main(){
+	char byte = 0;
+	if(__atomic_exchange_n(&my_fwd_pipeline.notify_pending, 1, __ATOMIC_ACQ_REL) == 0){
+		if(write(my_fwd_pipeline.notify_fds[1], &byte, 1) < 0){
+			__atomic_store_n(&my_fwd_pipeline.notify_pending, 0, __ATOMIC_RELEASE); //nonblocking and full, already awake
+		}
+	}
+}
+
+void *fwd_worker_main(void *arg){
+	struct fwd_worker *worker = arg;
+	struct fwd_job jobs[RX_BATCH_MAX];
+	fnaddr_t dests[RX_BATCH_MAX], next_hops[RX_BATCH_MAX];
+	int count = 0, i = 0, idle = 0;
+	
+	while(!__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE)){
+		for(count = 0; (count < RX_BATCH_MAX) && spsc_pop(&worker->to_worker, &jobs[count]); count++){
+			dests[count] = ((struct fishnet_l3_header *)jobs[count].l3frame)->dest;
+		}
+		if(count == 0){
+			if(++idle < 1000){
+				continue; //a new frame usually turns up within a few spins
+			}
+			/* park. sleeping goes up before the last look at the ring, the main
+			 * thread pushes before it reads sleeping, so one of us sees the other */
+			pthread_mutex_lock(&worker->lock);
+			__atomic_store_n(&worker->sleeping, 1, __ATOMIC_SEQ_CST);
+			if(!spsc_depth(&worker->to_worker) && !__atomic_load_n(&worker->stop, __ATOMIC_SEQ_CST)){
+				__atomic_fetch_add(&worker->sleeps, 1, __ATOMIC_RELAXED); //counters are read by "show fwd"
+				pthread_cond_wait(&worker->wake, &worker->lock);
+			}
+			__atomic_store_n(&worker->sleeping, 0, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&worker->lock);
+			idle = 0;
+			continue;
+		}
+		idle = 0;
+		
+		pthread_rwlock_rdlock(&my_fwd_lock);
+		lpm_batch(dests, next_hops, count);
+		pthread_rwlock_unlock(&my_fwd_lock);
+		__atomic_fetch_add(&worker->lookups, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&worker->looked_up, count, __ATOMIC_RELAXED);
+		
+		for(i = 0; i < count; i++){
+			jobs[i].next_hop = next_hops[i];
+			while(!spsc_push(&worker->to_main, &jobs[i])){
+				//the event loop is behind, it has to catch up before anything else moves
+				__atomic_fetch_add(&worker->stalls, 1, __ATOMIC_RELAXED);
+				fwd_notify_main();
+				sched_yield();
+			}
+		}
+		fwd_notify_main();
+	}
+	__atomic_store_n(&worker->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* main thread: send everything the workers have finished */
+int fwd_pipeline_drain(){
+	struct fwd_job job;
+	int i = 0, sent = 0;
+	for(; i < my_fwd_pipeline.num_workers; i++){
+		while(spsc_pop(&my_fwd_pipeline.workers[i].to_main, &job)){
+			l3_forward_to(job.l3frame, job.len, job.next_hop);
+			frame_release(job.l3frame);
+			my_fwd_pipeline.flows[job.flow].in_flight--;
+			my_fwd_pipeline.workers[i].sent++;
+			sent++;
+		}
+	}
+	return sent;
+}
+
+void fwd_pipeline_readable(int fd){
+	char bytes[64];
+	while(read(fd, bytes, sizeof(bytes)) > 0){
+		;
+	}
+	my_fwd_pipeline.notifies++;
+	//cleared before draining, anything finished after this point writes again
+	__atomic_store_n(&my_fwd_pipeline.notify_pending, 0, __ATOMIC_SEQ_CST);
+	fwd_pipeline_drain();
+}
+
+/* which flow bucket a frame belongs to, from src, dest and proto */
+int fwd_flow_hash(struct fishnet_l3_header *l3_header){
+	uint32_t hash = (uint32_t)l3_header->src * 0x9e3779b1u;
+	hash ^= (uint32_t)l3_header->dest * 0x85ebca6bu;
+	hash ^= l3_header->proto;
+	hash ^= hash >> 16; //fold the high bits down, the bucket comes from the low ones
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 13;
+	return hash & (FWD_FLOW_BUCKETS - 1);
+}
+
+/* picks the worker for a bucket. A bucket with frames still in flight stays
+ * put, an idle one moves if some other worker's queue is clearly shorter
+ */
+int fwd_flow_steer(int flow){
+	struct fwd_flow *bucket = &my_fwd_pipeline.flows[flow];
+	int i = 0, best = bucket->worker, depth = 0;
+	int best_depth = spsc_depth(&my_fwd_pipeline.workers[bucket->worker].to_worker);
+	if(bucket->in_flight > 0){
+		return bucket->worker;
+	}
+	for(; i < my_fwd_pipeline.num_workers; i++){
+		depth = spsc_depth(&my_fwd_pipeline.workers[i].to_worker);
+		if(depth + FWD_FLOW_SLACK < best_depth){
+			best = i;
+			best_depth = depth;
+		}
+	}
+	if(best != bucket->worker){
+		bucket->worker = best;
+		my_fwd_pipeline.rebalances++;
+	}
+	return best;
+}
+
+/* takes a transit frame (ttl already counted down) if the pipeline is
+ * running. Returns 1 if the frame was queued or dropped, 0 if the caller
+ * should forward it the usual way
+ */
+int fwd_pipeline_take(void *l3frame, int len){
+	struct fishnet_l3_header *l3_header = l3frame;
+	struct fwd_worker *worker = NULL;
+	struct fwd_job job;
+	if((my_fwd_pipeline.num_workers == 0) || (fish_l3.fish_l3_forward != my_fish_l3_forward) ||
+	   (fish_fwd.longest_prefix_match != my_longest_prefix_match)){
+		return 0;
+	}
+	if((l3_header->ttl == 0) || (l3_header->dest == ALL_NEIGHBORS)){
+		return 0; //no lookup to do, FCMP or flood right here
+	}
+	job.l3frame = frame_hold(l3frame, len);
+	if(job.l3frame == NULL){
+		return 0; //no buffer to hold it in, forward it here instead
+	}
+	job.len      = len;
+	job.next_hop = 0;
+	job.flow     = fwd_flow_hash(l3_header);
+	
+	worker = &my_fwd_pipeline.workers[fwd_flow_steer(job.flow)];
+	if(!spsc_push(&worker->to_worker, &job)){
+		worker->dropped++;
+		frame_release(job.l3frame);
+		return 1;
+	}
+	worker->submitted++;
+	my_fwd_pipeline.flows[job.flow].in_flight++;
+	my_fwd_pipeline.flows[job.flow].frames++;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST); //push is visible before we look at sleeping
+	if(__atomic_load_n(&worker->sleeping, __ATOMIC_SEQ_CST)){
+		pthread_mutex_lock(&worker->lock);
+		pthread_cond_signal(&worker->wake);
+		pthread_mutex_unlock(&worker->lock);
+	}
+	return 1;
+}
+
+void fwd_pipeline_start(int num_workers, int ring_size){
+	struct fwd_worker *worker = NULL;
+	int size = 1, i = 0;
+	while(size < ring_size){
+		size <<= 1;
+	}
+	if(my_fwd_pipeline.notify_fds[0] < 0){
+		if(pipe(my_fwd_pipeline.notify_fds) < 0){
+			exit(3902);
+		}
+		fcntl(my_fwd_pipeline.notify_fds[0], F_SETFL, O_NONBLOCK);
+		fcntl(my_fwd_pipeline.notify_fds[1], F_SETFL, O_NONBLOCK);
+		fish_readhook(my_fwd_pipeline.notify_fds[0], fwd_pipeline_readable);
+	}
+	my_fwd_pipeline.ring_size = size;
+	//nothing is in flight after a stop, so every bucket is free to start anywhere
+	for(i = 0; i < FWD_FLOW_BUCKETS; i++){
+		my_fwd_pipeline.flows[i].worker    = i % num_workers;
+		my_fwd_pipeline.flows[i].in_flight = 0;
+	}
+	for(i = 0; i < num_workers; i++){
+		worker = &my_fwd_pipeline.workers[i];
+		memset(worker, 0, sizeof(struct fwd_worker));
+		worker->index = i;
+		spsc_init(&worker->to_worker, size);
+		spsc_init(&worker->to_main, size);
+		pthread_mutex_init(&worker->lock, NULL);
+		pthread_cond_init(&worker->wake, NULL);
+		if(pthread_create(&worker->thread, NULL, fwd_worker_main, worker) != 0){
+			exit(3903);
+		}
+	}
+	my_fwd_pipeline.num_workers = num_workers;
+}
+
+/* joins the workers, then finishes whatever they left behind on this thread */
+void fwd_pipeline_stop(){
+	struct fwd_worker *worker = NULL;
+	struct fwd_job job;
+	int i = 0;
+	for(; i < my_fwd_pipeline.num_workers; i++){
+		worker = &my_fwd_pipeline.workers[i];
+		pthread_mutex_lock(&worker->lock);
+		__atomic_store_n(&worker->stop, 1, __ATOMIC_SEQ_CST);
+		pthread_cond_signal(&worker->wake);
+		pthread_mutex_unlock(&worker->lock);
+		//it may be waiting on room in to_main to finish its last burst
+		while(!__atomic_load_n(&worker->done, __ATOMIC_ACQUIRE)){
+			fwd_pipeline_drain();
+			sched_yield();
+		}
+		pthread_join(worker->thread, NULL);
+	}
+	fwd_pipeline_drain();
+	for(i = 0; i < my_fwd_pipeline.num_workers; i++){
+		worker = &my_fwd_pipeline.workers[i];
+		while(spsc_pop(&worker->to_worker, &job)){
+			my_fish_l3_forward(job.l3frame, job.len);
+			frame_release(job.l3frame);
+			my_fwd_pipeline.flows[job.flow].in_flight--;
+			worker->sent++;
+		}
+		free(worker->to_worker.slots);
+		free(worker->to_main.slots);
+		pthread_mutex_destroy(&worker->lock);
+		pthread_cond_destroy(&worker->wake);
+	}
+	my_fwd_pipeline.num_workers = 0;
+}
+
+/* brings the running pipeline in line with fwd_workers and fwd_ring_size */
+void fwd_pipeline_apply(){
+	int ring_size = 1;
+	while(ring_size < fwd_ring_size){
+		ring_size <<= 1;
+	}
+	if((fwd_workers == my_fwd_pipeline.num_workers) && 
+	   ((fwd_workers == 0) || (ring_size == my_fwd_pipeline.ring_size))){
+		return;
+	}
+	fwd_pipeline_stop();
+	if(fwd_workers > 0){
+		fwd_pipeline_start(fwd_workers, fwd_ring_size);
+	}
+}
+
+void print_my_fwd_pipeline(){
+	struct fwd_worker *worker = NULL;
+	int flows[FWD_MAX_WORKERS] = {0};
+	int i = 0, active = 0;
+	fprintf(stdout, "\n"
+		"                    FORWARDING PIPELINE                    \n"
+		" ========================================================= \n");
+	if(my_fwd_pipeline.num_workers == 0){
+		fprintf(stdout, " Off, transit frames are forwarded on the event loop\n");
+		return;
+	}
+	for(; i < FWD_FLOW_BUCKETS; i++){
+		if(my_fwd_pipeline.flows[i].frames){
+			flows[my_fwd_pipeline.flows[i].worker]++;
+			active++;
+		}
+	}
+	fprintf(stdout, " %d workers, %d slots per ring, %lu wakeups from the workers\n",
+		my_fwd_pipeline.num_workers, my_fwd_pipeline.ring_size, my_fwd_pipeline.notifies);
+	fprintf(stdout, " %d of %d flow buckets used, %lu moved while idle\n",
+		active, FWD_FLOW_BUCKETS, my_fwd_pipeline.rebalances);
+	fprintf(stdout, " Worker   In   Out  Flows   Submitted     Sent  Dropped   Bursts  Stalls  Sleeps\n"
+		" ------ ---- -----  -----   ---------  -------  -------  -------  ------  ------\n");
+	for(i = 0; i < my_fwd_pipeline.num_workers; i++){
+		worker = &my_fwd_pipeline.workers[i];
+		fprintf(stdout, " %6d %4d %5d  %5d   %9lu  %7lu  %7lu  %7lu  %6lu  %6lu\n",
+			worker->index,
+			spsc_depth(&worker->to_worker),
+			spsc_depth(&worker->to_main),
+			flows[i],
+			worker->submitted,
+			worker->sent,
+			worker->dropped,
+			__atomic_load_n(&worker->lookups, __ATOMIC_RELAXED),
+			__atomic_load_n(&worker->stalls, __ATOMIC_RELAXED),
+			__atomic_load_n(&worker->sleeps, __ATOMIC_RELAXED));
+	}
+}
+
+/* ========================================================= */
+/* ===================== Runtime Settings ================== */
+/* ========================================================= */
+struct fishnode_setting my_settings[] = {
+	{"dv_aggregate", &dv_aggregate, 0, 1, "Summarize sibling prefixes in dv advertisements"},
+	{"dv_batch", &dv_batch, 0, 1, "Apply dv packets once per tick"},
+	{"dv_batch_tick", &dv_batch_tick, 10, 5000, "Batch tick in ms"},
+	{"dv_refresh", &dv_refresh, 5, 300, "Seconds between full dv advertisements"},
+	{"rx_batch", &rx_batch, 0, 1, "Process received frames in batches"},
+	{"rx_batch_size", &rx_batch_size, 1, RX_BATCH_MAX, "Frames per receive batch"},
+	{"fwd_workers", &fwd_workers, 0, FWD_MAX_WORKERS, "Forwarding threads, 0 forwards on the event loop"},
+	{"arp_queue", &arp_queue, 1, ARP_QUEUE_MAX, "Frames that can wait on one ARP lookup"},
+	{"arp_refresh", &arp_refresh, 0, ARP_TIMEOUT - 10, "Seconds before expiry to refresh ARP entries in use, 0 is off"},
+	{"arp_glean", &arp_glean, 0, ARP_TIMEOUT - 10, "Seconds between gleaning one ARP entry from traffic, 0 is off"},
+	{"arp_glean_rate", &arp_glean_rate, 0, 100000, "New or changed ARP entries gleaned per second, 0 is unlimited"},
+	{"bcast_rpf", &bcast_rpf, 0, 1, "Flood broadcasts only when they arrive over the route back to their source"},
+	{"egress_sched", &egress_sched, 0, 1, "Send frames through the strict priority queues"},
+	{"egress_budget", &egress_budget, 1, EGRESS_DEPTH_MAX, "Frames sent per turn of the event loop"},
+	{"egress_control_depth", &egress_control_depth, 1, EGRESS_DEPTH_MAX, "Queue depth for neighbor, DV and ARP frames"},
+	{"egress_signal_depth", &egress_signal_depth, 1, EGRESS_DEPTH_MAX, "Queue depth for FCMP and name frames"},
+	{"egress_data_depth", &egress_data_depth, 1, EGRESS_DEPTH_MAX, "Queue depth for everything else"},
+	{"nh_pace_rate", &nh_pace_rate, 0, 1000000000, "Bytes per second forwarded to each next hop, 0 is unpaced"},
+	{"nh_pace_burst", &nh_pace_burst, MTU, 16777216, "Bytes each next hop can be sent at once"},
+	{"nh_queue_bytes", &nh_queue_bytes, POOL_BUF_SIZE, 16777216, "Buffer bytes the frames waiting on each next hop can pin"},
+	{"fcmp_src_rate", &fcmp_src_rate, 0, 100000, "FCMP errors per second to one source, 0 is unlimited"},
+	{"fcmp_src_burst", &fcmp_src_burst, 1, 100000, "FCMP errors one source can get at once"},
+	{"fcmp_rate", &fcmp_rate, 0, 100000, "FCMP errors per second from this node, 0 is unlimited"},
+	{"fcmp_burst", &fcmp_burst, 1, 100000, "FCMP errors this node can send at once"},
+	{"fwd_ring_size", &fwd_ring_size, 16, FWD_RING_MAX, "Frames queued to and from each worker"},
+	{"neigh_probe_min", &neigh_probe_min, 1, 60, "Fastest neighbor probe on a quiet link, seconds"},
+	{"neigh_probe_max", &neigh_probe_max, 1, 100, "Slowest neighbor probe on a busy link, seconds"},
+	{"fast_hello", &fast_hello, 0, 1, "Sub-second neighbor liveness"},
+	{"fast_hello_interval", &fast_hello_interval, FAST_HELLO_MIN_MS, FAST_HELLO_MAX_MS, "Fast hello interval in ms"},
+	{"fast_hello_mult", &fast_hello_mult, FAST_HELLO_MULT_MIN, FAST_HELLO_MULT_MAX, "Missed fast hellos before a neighbor is down"},
+	{NULL, NULL, 0, 0, NULL}
+};
+
+void print_my_settings(){
+	fprintf(stdout, "\n"
+		"                         SETTINGS                          \n"
+		" ========================================================= \n"
+		"     Name                 Value   Range          Description  \n"
+		" -------------------    -------   -------------  -----------  \n");
+	int i = 0;
+	for(; my_settings[i].name != NULL; i++){
+		fprintf(stdout, " %-20s %8d   [%d, %d]   %s\n",
+			my_settings[i].name,
+			*my_settings[i].value,
+			my_settings[i].min,
+			my_settings[i].max,
+			my_settings[i].help);
+	}
+}
+
+/* handles "set <name> <value>", returns 1 if the setting was changed */
+int change_setting(char *line){
+	char name[64];
+	int value = 0, i = 0;
+	if(sscanf(line, "%63s %d", name, &value) != 2){
+		printf("Usage: set <name> <value>\n");
+		return 0;
+	}
+	for(; my_settings[i].name != NULL; i++){
+		if(0 == strcasecmp(my_settings[i].name, name)){
+			if((value < my_settings[i].min) || (value > my_settings[i].max)){
+				printf("%s must be between %d and %d\n", my_settings[i].name, my_settings[i].min, my_settings[i].max);
+				return 0;
+			}
+			*my_settings[i].value = value;
+			return 1;
+		}
+	}
+	printf("Unknown setting: %s\n", name);
+	return 0;
 }
 
 /* ========================================================= */
@@ -980,13 +4364,41 @@ static void keyboard_callback(char *line)
    if (0 == strcasecmp("show neighbors", line))
       print_my_neighbor_table();
    else if (0 == strcasecmp("show arp", line)){ //edited for my own table
-      fish_print_arp_table();
+      print_my_arp_table();
    }
    else if (0 == strcasecmp("show route", line)){
       print_my_forwarding_table();
    }
    else if (0 == strcasecmp("show dv", line))
       print_my_dv_table();
+   else if (0 == strcasecmp("show settings", line))
+      print_my_settings();
+   else if (0 == strcasecmp("show pool", line))
+      print_my_pool();
+   else if (0 == strcasecmp("show rx", line))
+      print_my_rx_batch();
+   else if (0 == strcasecmp("show rpf", line))
+      print_my_rpf();
+   else if (0 == strcasecmp("show rib", line))
+      print_my_rib_in();
+   else if (0 == strcasecmp("rib recompute", line))
+      rib_recompute_all();
+   else if (0 == strcasecmp("show fcmp", line))
+      print_my_fcmp_limiter();
+   else if (0 == strcasecmp("show l2", line))
+      print_my_l2();
+   else if (0 == strcasecmp("show protos", line))
+      print_my_l3_dispatch();
+   else if (0 == strcasecmp("show fwd", line))
+      print_my_fwd_pipeline();
+   else if (0 == strcasecmp("show egress", line))
+      print_my_egress();
+   else if (0 == strcasecmp("show pacing", line))
+      print_my_nh_queues();
+   else if (0 == strncasecmp("set ", line, 4)){
+      if (change_setting(line + 4))
+         fwd_pipeline_apply();
+   }
    else if (0 == strcasecmp("quit", line) || 0 == strcasecmp("exit", line))
       fish_main_exit();
    else if (0 == strcasecmp("show topo", line))
@@ -996,10 +4408,23 @@ static void keyboard_callback(char *line)
              "    exit                         Quit the fishnode\n"
              "    help                         Display this message\n"
              "    quit                         Quit the fishnode\n"
+             "    rib recompute                Rebuild dv routes from the received routes\n"
+             "    set <name> <value>           Change one of the settings\n"
              "    show arp                     Display the ARP table\n"
              "    show dv                      Display the dv routing state\n"
+             "    show egress                  Display the egress queues by class\n"
+             "    show fcmp                    Display FCMP errors sent and suppressed\n"
+             "    show fwd                     Display the forwarding pipeline queues\n"
+             "    show l2                      Display L2 send and receive counters\n"
              "    show neighbors               Display the neighbor table\n"
+             "    show pacing                  Display the per next hop queues\n"
+             "    show pool                    Display packet buffer pool usage\n"
+             "    show protos                  Display frames delivered to each L3 protocol\n"
+             "    show rib                     Display the routes each neighbor advertised\n"
              "    show route                   Display the forwarding table\n"
+             "    show rpf                     Display broadcasts flooded and suppressed\n"
+             "    show rx                      Display receive batching counters\n"
+             "    show settings                Display the settings and their values\n"
              "    show topo                    Display the link-state routing\n"
              "                                 algorithm's view of the network\n"
              "                                 topology\n"
@@ -1028,6 +4453,16 @@ int main(int argc, char **argv)
 	fish_l3.fish_l3_send = my_fish_l3_send;
 	fish_l3.fishnode_l3_receive = my_fishnode_l3_receive;
 	fish_l3.fish_l3_forward = my_fish_l3_forward;
+	l3_register_handler(L3_PROTO_DV, l3_handle_dv);
+	l3_register_handler(L3_PROTO_NEIGH, l3_handle_neigh);
+	fish_l2.fishnode_l2_receive = my_fishnode_l2_receive;
+	fish_l2.fish_l2_send = my_fish_l2_send;
+	egress_init();
+	fish_arp.add_arp_entry    = my_add_arp_entry;
+	fish_arp.resolve_fnaddr   = my_resolve_fnaddr;
+	fish_arp.arp_received     = my_arp_received;
+	fish_arp.send_arp_request = my_send_arp_request;
+	select_cksum_kernel();
 
 	/* custom pointers for advanced functionality */
 	fish_fwd.add_fwtable_entry     = my_add_fwtable_entry;
@@ -1074,8 +4509,15 @@ int main(int argc, char **argv)
 	else
 		fish_joinnetwork_addr(argv[arg_offset], fn_aton(argv[arg_offset+1]));
 
+	my_l2.address = fish_getl2address();
+	l2_broadcast_template.dest = ALL_L2_NEIGHBORS;
+	l2_broadcast_template.src  = my_l2.address;
+
    	/* Install the command line parsing callback */
    	fish_keybhook(keyboard_callback);
+
+	/* hear about neighbors leaving without waiting on a timeout */
+	fish_register_neighbor_down_handler(libfish_neighbor_down);
    	if (!noprompt)
       	printf("> ");
    	fflush(stdout);
@@ -1113,6 +4555,7 @@ int main(int argc, char **argv)
 		exit(51);
 	}
 	my_dv_table_size = 128;
+	init_dv_entries(0, my_dv_table_size);
 	
 	/* initialize our forwarding table */
 	my_forwarding_table = calloc(sizeof(struct forwarding_table_entry), 256);
@@ -1122,6 +4565,9 @@ int main(int argc, char **argv)
 	}
 	my_forwarding_table_size = 256;
 
+	my_arp.free_list = -1;
+	arp_grow();
+
 	/* initialize our struct of packet ids seen */
 	packet_ids_seen = calloc(sizeof(struct packet_check), packet_ids_seen_size);
 	if(packet_ids_seen == NULL){
@@ -1136,24 +4582,22 @@ int main(int argc, char **argv)
 	
 	/*make our neighbors table */
 
-	my_neighbor_table = calloc(sizeof(struct neighbor_entry), 64);
-	if(my_neighbor_table == NULL){
-		fprintf(stderr, "Unable to initialize neighbor table with 64 entries! Exiting!\n");
-		exit(54);
-	}
-	my_neighbor_table_size = 64;
+	init_neighbor_table(64);
 
 	
 	/* start our decrement of the table */
 	decrement_neighbor_table();
+	fast_hello_tick();
 	
 	/* start our decrement of the dv table */
 	decrement_dv_table();
+	arp_tick();
 	
 	/* Execute the libfish event loop */
 	fish_main();
 
    	/* Clean up and exit */
+	fwd_pipeline_stop();
   	if (!noprompt)
       	printf("\n");
 
@@ -4,9 +4,11 @@
 
 #include "fish.h"
 #include <stdint.h>
+#include <pthread.h>
 
 /* constants */
 #define MAX_IDS_SEEN 256
+#define MAX_IDS_KEPT (MAX_IDS_SEEN * 16) //the seen table stops growing here and wraps
 
 
 #define L2_HEADER_LENGTH 16 	//in bytes -- constant
@@ -23,6 +25,11 @@
 #define L3_PROTO_DV	7
 #define L3_PROTO_FCMP	8
 #define L3_PROTO_ARP	9
+#define L3_PROTOS	256	//every value of the proto byte
+
+/* what an L3 protocol handler returns */
+#define L3_PASS     0	//hand the frame on up to l4
+#define L3_CONSUMED 1	//the handler used it up, nothing else sees it
 
 /* FCMP Error IDs */
 #define FCMP_TTL_EXCEEDED     1 
@@ -33,6 +40,13 @@
 #define NEIGH_REQUEST  1
 #define NEIGH_RESPONSE 2
 #define NEIGH_TTL      1
+#define NEIGH_FAST_HELLO 3 //ours, not in the spec: liveness hello, fast_hello_header follows
+#define FAST_HELLO_MIN_MS   50	//interval bounds, for our setting and for what peers send
+#define FAST_HELLO_MAX_MS   10000
+#define FAST_HELLO_MULT_MIN 2
+#define FAST_HELLO_MULT_MAX 50
+
+#define FAST_HELLO_LENGTH 10 //neighbor header included
 
 /* changes to dv table */
 #define DV_UPDATE   1 
@@ -41,6 +55,49 @@
 
 #define MAX_ADV_IN_PACKET 120 //I think this is right
 
+/* room kept in front of a locally built payload for the headers below it */
+#define PKT_HEADROOM (L2_HEADER_LENGTH + L3_HEADER_LENGTH)
+
+/* buffer pool: every buffer holds a full MTU frame behind a small header */
+#define POOL_BUF_SIZE   ((MTU + 16 + 63) & ~63) //rounded to whole cache lines
+#define POOL_BUF_DATA   (POOL_BUF_SIZE - 16)	//room for the frame itself
+#define POOL_SLAB_BUFS  64	//buffers carved out of each slab
+#define POOL_MAX_SLABS  1024	//the cap, pool_get returns NULL past it
+#define POOL_SLAB_BYTES (POOL_SLAB_BUFS * POOL_BUF_SIZE)
+#define POOL_ARENA_BYTES ((size_t)POOL_MAX_SLABS * POOL_SLAB_BYTES) //address space reserved up front
+#define POOL_CACHE_MAX  32	//buffers a thread keeps before handing half back
+
+#define RX_BATCH_MAX 64
+
+#define FWD_MAX_WORKERS 8
+#define FWD_RING_MAX    4096	//slots per ring, rounded up to a power of two
+#define FWD_FLOW_BUCKETS 1024	//flows hash into these, a bucket is steered as one
+#define FWD_FLOW_SLACK   8	//queue depth difference worth moving an idle bucket for
+
+/* ARP, per the spec: 4 tries 2.5 seconds apart, answers kept 180 seconds */
+#define ARP_REQUEST       1
+#define ARP_RESPONSE      2
+#define ARP_HEADER_LENGTH 14
+#define ARP_TIMEOUT       180
+#define ARP_TRIES         4
+#define ARP_RETRY_MS      2500
+#define ARP_TICK_MS       250
+#define ARP_QUEUE_MAX     64	//most frames the arp_queue setting lets wait on one address
+#define ARP_HOT_MS        30000	//used this recently counts as in use for refreshing
+
+/* egress classes, sent in strict priority order */
+#define EGRESS_CONTROL   0	//neighbor discovery, DV and ARP: what keeps adjacencies up
+#define EGRESS_SIGNAL    1	//FCMP errors and name lookups
+#define EGRESS_DATA      2	//everything else
+#define EGRESS_CLASSES   3
+#define EGRESS_DEPTH_MAX 4096	//queue slots per class, a power of two
+
+#define NH_HASH_SIZE 64	//buckets for the per next hop queues
+#define NH_PACE_MS   2	//how often backlogged next hops are paced out
+
+#define FCMP_SOURCES 256	//per source rate limit slots
+#define FCMP_KINDS   4	//counters by error id, 0 for anything unknown
+
 /* structs */
 struct neighbor_header{
 	uint16_t 	type;
@@ -50,8 +107,24 @@ struct neighbor_entry{
 	fnaddr_t neigh;
 	uint32_t ttl;
 	uint8_t  valid;
+	int      hash_next; //next slot in the same hash bucket, -1 ends
+	int      free_next; //next free slot while not valid, -1 ends
+	uint8_t  fast_live;     //neighbor sends fast hellos, so we watch its deadline
+	uint32_t fast_detect;   //ms of silence before we call it down
+	uint64_t fast_deadline; //monotonic ms
+	uint16_t probe_interval; //seconds of silence before we ask, adapts to the traffic
+	uint16_t probe_due;      //silence (120 - ttl) at which the next probe goes out
+	uint8_t  probed;         //asked since we last heard from it
 };
 
+struct fast_hello_header{
+	uint16_t 	type;		//NEIGH_FAST_HELLO, rides on the neighbor protocol
+	uint16_t 	interval;	//ms between the sender's hellos
+	uint8_t 	detect_mult;	//hellos the sender allows us to miss
+	uint8_t 	flags;		//unused, zero
+	uint32_t 	seq;
+}__attribute__((packed));
+
 struct dv_entry{
 	uint8_t  in_forwarding_table;
 	uint8_t  valid;
@@ -62,6 +135,37 @@ struct dv_entry{
 	int 	 metric;
 	uint32_t ttl;
 	void    *fwd_table_ptr;	
+	uint8_t  dirty;    //changed since the advertisement cache last looked at it
+	int      adv_slot; //position in the advertisement cache, -1 if not advertised
+	int      hop_prev; //valid entries sharing this next hop, by index, -1 ends
+	int      hop_next;
+	int      dest_prev; //valid entries for the same destination, by index, -1 ends
+	int      dest_next;
+};
+
+/* every valid dv entry for one destination and netmask, chained through the entries */
+struct dv_dest{
+	fnaddr_t 	dest;
+	fnaddr_t 	netmask;
+	int 		head;		//dv table index, -1 if empty
+	int 		count;
+	uint8_t 	alt_pending;	//waiting for its loop free alternate to be picked again
+	int 		touched;	//its slot in my_dv_batch.touched while a batch has it, -1 otherwise
+	int 		hash_next;	//-1 ends
+	int 		free_next;	//-1 ends
+};
+
+struct dv_dest_table{
+	struct dv_dest 	*dests;
+	int 		size;
+	int 		num_dests;
+	int 		*hash;		//bucket heads, twice the table size
+	int 		hash_size;
+	int 		free_list;
+	int 		*pending;	//dests with alt_pending set
+	int 		num_pending;
+	int 		pending_size;
+	uint8_t 	scheduled;	//a flush is waiting on the event loop
 };
 
 
@@ -70,6 +174,13 @@ struct packet_check{
 	fnaddr_t source;
 };
 
+struct fishnet_l2_header{
+	fn_l2addr_t 	dest;
+	fn_l2addr_t 	src;
+	uint16_t 	checksum;	//internet checksum over the whole frame
+	uint16_t 	length;		//whole frame, header included
+}__attribute__((packed));
+
 struct fishnet_l3_header{
 	uint8_t 	ttl;
 	uint8_t 	proto;
@@ -90,6 +201,22 @@ struct forwarding_table_entry{
 	uint8_t 	is_best; //printing ">" for some reason
 	void *		route_key;
 	void *		user_data;
+	fnaddr_t 	alt_next_hop;	//loop free alternate, 0 if there is none
+	int 		alt_metric;
+	int 		hop_prev;	//entries sharing this next hop, by index, -1 ends
+	int 		hop_next;
+};
+
+/* the forwarding entries that leave through one next hop */
+struct next_hop_index{
+	fnaddr_t 	next_hop;
+	int 		head;		//forwarding table index, -1 if empty
+	int 		count;
+};
+
+struct next_hop_table{
+	struct next_hop_index 	*hops;
+	int 			size;
 };
 
 struct dv_adv{
@@ -103,10 +230,433 @@ struct dv_packet{
 	struct dv_adv 	adv_packets; //could be multiple depending on num_adv
 }__attribute__((packed));
 
+/* an advertisement before it is serialized, dest in HOST ORDER for prefix math */
+struct adv_candidate{
+	uint32_t 	dest;
+	int 		prefix_length;
+	int 		metric;
+	fnaddr_t 	next_hop;
+	int 		aggregate;	//made by merging siblings, not a dv entry of its own
+};
+
+/* our broadcast advertisement, kept serialized between sends. Only entries
+ * that went dirty are re-serialized, so a steady state refresh is a copy */
+struct adv_cache{
+	struct adv_candidate 	*cands;		//one per advertised dv entry, kept compact
+	int 			*owner;		//dv table index behind each candidate
+	int 			num_cands;	//advertised routes, maintained incrementally
+	int 			size;		//room in cands, owner and frame
+	void 			*frame;		//headroom, dv header and then the wire records
+	int 			num_wire;	//records serialized in frame
+	int 			aggregated;	//frame holds the summarized records
+	int 			rebuild;	//frame must be regenerated from cands
+	int 			*dirty;		//dv table indexes waiting to be looked at
+	int 			num_dirty;
+	int 			dirty_size;
+	void 			*chunk;		//scratch frame for tables bigger than one packet
+	struct adv_candidate 	*aggregates;	//summaries on the wire, MAX_TTL while their withdrawal is unsent
+	int 			num_aggregates;
+	int 			aggregates_size;
+	int 			num_withdrawing;	//withdrawals at the end of the wire records, not sent yet
+};
+
+/* a dv packet waiting for the next batch tick */
+struct dv_queued{
+	fnaddr_t 	source;
+	int 		len;
+	void 		*dv_frame;	//our own copy
+};
+
+/* a destination whose forwarding entry the batch owes a fix-up */
+struct dv_touched{
+	fnaddr_t 	dest;
+	fnaddr_t 	netmask;
+	int 		d;		//its dest record, kept until the batch is reconciled
+	int 		winner;		//dv table index, -1 for no route
+	void 		*kept;		//forwarding entry that ends up holding the route
+};
+
+struct dv_batch_state{
+	struct dv_queued 	*queue;
+	int 			num_queued;
+	int 			queue_size;
+	struct dv_touched 	*touched;
+	int 			num_touched;
+	int 			touched_size;
+	uint8_t 		scheduled;	//tick event is pending
+	uint8_t 		running;	//forwarding table writes are deferred
+	int 			packets_queued;
+	int 			batches_run;
+	int 			fwd_writes;
+};
+
+/* one route as a neighbor last advertised it, 12 bytes like on the wire */
+struct rib_route{
+	fnaddr_t 	dest;
+	fnaddr_t 	netmask;
+	uint16_t 	metric;		//as advertised, MAX_TTL is a withdrawal
+	uint16_t 	ttl;
+};
+
+/* Adj-RIB-In: one neighbor's latest advertised vector */
+struct adj_rib_in{
+	uint8_t 	valid;
+	fnaddr_t 	neighbor;
+	struct rib_route *routes;	//sorted by dest, then netmask
+	int 		num_routes;
+	int 		size;
+};
+
+/* a frame under construction. data moves towards head as each layer
+ * pushes its header into the headroom, nothing gets copied on the way down */
+struct pkt_buf{
+	uint8_t 	*head;		//start of the storage
+	uint8_t 	*data;		//first byte of the outermost header so far
+	int 		len;		//bytes from data on
+	uint8_t 	owned;		//PKT_POOL or PKT_HEAP when pkt_init allocated head
+};
+
+#define PKT_WRAPPED 0	//caller's storage
+#define PKT_POOL    1	//a pool buffer
+#define PKT_HEAP    2	//too big for the pool
+
+/* front of every pool buffer, the frame starts right after it */
+struct pool_buf{
+	union{
+		struct pool_buf *next;	//while free
+		int 	refcnt;		//while handed out
+	};
+	uint8_t 	pad[16 - sizeof(void *)];
+};
+
+/* per thread stash, so the common get/put never touches the lock */
+struct pool_cache{
+	struct pool_buf *free;
+	int 		count;
+};
+
+struct buf_pool{
+	struct pool_buf *free;		//shared free list, under lock
+	int 		num_free;
+	uint8_t 	*arena;		//every slab, carved in order, so a lookup is one subtraction
+	int 		num_slabs;
+	int 		in_use;		//handed out right now
+	int 		high_water;
+	unsigned long 	gets;
+	unsigned long 	heap_fallbacks;	//requests bigger than a buffer, or past the cap
+	unsigned long 	holds;		//extra references taken on pool frames
+	unsigned long 	hold_copies;	//frames that had to be copied to be held
+	unsigned long 	exhausted;	//gets refused at POOL_MAX_SLABS
+};
+
+/* a received frame waiting for the rest of its batch */
+struct rx_frame{
+	void 		*l3frame;	//held, released once the batch is done
+	int 		len;
+	uint8_t 	local;		//for us (or broadcast)
+	uint8_t 	forward;	//goes back out
+	uint8_t 	from_valid;
+	fn_l2addr_t 	from;		//L2 sender, for the reverse path check
+	fnaddr_t 	next_hop;
+};
+
+struct rx_batch_state{
+	struct rx_frame frames[RX_BATCH_MAX];
+	int 		count;
+	uint8_t 	scheduled;
+	unsigned long 	batches;
+	unsigned long 	frames_total;
+	unsigned long 	dropped;	//no pool buffer to hold them in
+	int 		largest;
+};
+
+/* a transit frame on its way through a forwarding worker */
+struct fwd_job{
+	void 		*l3frame;	//held, released by the main thread after sending
+	int 		len;
+	fnaddr_t 	next_hop;	//filled in by the worker, 0 for no route
+	int 		flow;		//bucket it was steered by
+};
+
+/* every flow hashing here goes to the same worker. While any of its frames
+ * are in a ring it can't move, or a later frame could overtake an earlier one
+ */
+struct fwd_flow{
+	uint8_t 	worker;
+	int 		in_flight;	//handed to the worker and not sent yet
+	unsigned long 	frames;
+};
+
+/* single producer, single consumer. Each side only writes its own index, so
+ * the two never share a lock. They sit on separate cache lines so the
+ * producer and consumer don't keep stealing the line from each other
+ */
+struct spsc_ring{
+	struct fwd_job 	*slots;
+	unsigned int 	mask;		//size - 1
+	unsigned int 	head __attribute__((aligned(64)));	//next slot to fill, producer only
+	unsigned int 	tail __attribute__((aligned(64)));	//next slot to empty, consumer only
+};
+
+struct fwd_worker{
+	pthread_t 	thread;
+	int 		index;
+	struct spsc_ring to_worker;	//main thread -> worker
+	struct spsc_ring to_main;	//worker -> main thread
+	pthread_mutex_t lock;		//only for sleeping and waking
+	pthread_cond_t 	wake;
+	int 		sleeping;
+	int 		stop;
+	int 		done;		//worker has returned
+	unsigned long 	submitted;	//main thread's counters
+	unsigned long 	dropped;	//to_worker was full
+	unsigned long 	sent;
+	unsigned long 	looked_up;	//worker's counters
+	unsigned long 	lookups;	//table passes, each covers a whole burst
+	unsigned long 	stalls;		//waits on a full to_main
+	unsigned long 	sleeps;
+};
+
+struct fwd_pipeline{
+	struct fwd_worker workers[FWD_MAX_WORKERS];
+	int 		num_workers;	//running right now
+	int 		ring_size;
+	struct fwd_flow flows[FWD_FLOW_BUCKETS];	//main thread only
+	unsigned long 	rebalances;	//idle buckets moved to a shorter queue
+	int 		notify_fds[2];	//workers write, the event loop reads
+	int 		notify_pending;
+	unsigned long 	notifies;
+};
+
+/* our L2 receive path and what it has dropped */
+struct l2_receive_state{
+	uint16_t 	(*cksum)(const void *frame, int len);	//picked by select_cksum_kernel
+	const char 	*cksum_name;
+	fn_l2addr_t 	address;	//ours, cached once we have joined
+	fn_l2addr_t 	from;		//L2 source of the frame being handed up right now
+	uint8_t 	from_valid;	//only while inside our L2 receive
+	unsigned long 	received;
+	unsigned long 	bad_cksum;
+	unsigned long 	bad_length;
+	unsigned long 	not_mine;
+	unsigned long 	sent;
+	unsigned long 	send_copies;	//frames without our headroom in front
+	unsigned long 	no_buffer;	//dropped, the pool was exhausted
+	unsigned long 	arp_waits;
+	unsigned long 	host_unreachable;
+	unsigned long 	too_big;
+};
+
+struct arp_header{
+	uint32_t 	type;		//ARP_REQUEST or ARP_RESPONSE
+	fnaddr_t 	addr;		//the L3 address being resolved
+	fn_l2addr_t 	l2addr;		//its L2 address, responses only
+}__attribute__((packed));
+
+/* a frame our fish_l2_send parked behind an ARP lookup */
+struct l2_pending{
+	void 		*l3frame;	//held, with L2 headroom in front
+	int 		len;
+	fnaddr_t 	next_hop;
+};
+
+struct arp_waiter{
+	arp_resolution_cb cb;
+	void 		*param;
+};
+
+struct arp_entry{
+	fnaddr_t 	addr;
+	fn_l2addr_t 	l2addr;
+	uint8_t 	valid;
+	uint8_t 	resolved;	//l2addr is good until expires
+	uint8_t 	pending;	//a request is out
+	uint8_t 	refreshing;	//asked again before expiring, still answering meanwhile
+	uint8_t 	tries;
+	uint64_t 	expires;	//monotonic ms
+	uint64_t 	retry_at;	//monotonic ms
+	uint64_t 	last_used;	//monotonic ms of the last lookup it answered
+	uint64_t 	gleaned_at;	//monotonic ms it was last learned from a received frame
+	unsigned long 	uses;
+	struct fishnet_l2_header l2_template;	//dest and src filled in, good while resolved
+	struct arp_waiter *queue;	//queue_size long while anything waits, NULL otherwise
+	int 		queue_size;	//arp_queue when the queue was allocated
+	int 		num_waiting;
+	int 		hash_next;	//next slot in the same bucket, -1 ends
+	int 		free_next;	//next free slot while not valid, -1 ends
+};
+
+/* tokens in thousandths so slow rates still refill every ms */
+struct token_bucket{
+	uint64_t 	tokens;
+	uint64_t 	last_ms;
+};
+
+struct egress_frame{
+	void 		*l3frame;	//held, with L2 headroom in front
+	int 		len;
+	fnaddr_t 	next_hop;
+};
+
+struct egress_queue{
+	struct egress_frame *frames;	//EGRESS_DEPTH_MAX slots, made on first use
+	int 		head;
+	int 		count;
+	int 		high_water;
+	unsigned long 	queued;
+	unsigned long 	sent;
+	unsigned long 	dropped;	//arrived to a full queue
+};
+
+struct egress_scheduler{
+	uint8_t 	class_of[256];	//by L3 proto
+	struct egress_queue queues[EGRESS_CLASSES];
+	uint8_t 	scheduled;	//a drain is waiting on the event loop
+	unsigned long 	drains;
+};
+
+/* forwarded frames waiting on one next hop's pacing */
+struct nh_queue{
+	fnaddr_t 	next_hop;
+	struct egress_frame *frames;	//ring, doubles when full
+	int 		size;
+	int 		head;
+	int 		count;
+	int 		bytes;		//frame bytes waiting, the pool buffers they pin are count * POOL_BUF_SIZE
+	int 		high_water;	//in bytes
+	struct token_bucket bucket;	//in bytes
+	int 		hash_next;	//-1 ends
+	unsigned long 	sent;
+	unsigned long 	paced;		//had to wait before going out
+	unsigned long 	dropped;
+	unsigned long 	dropped_bytes;
+};
+
+struct nh_queue_table{
+	struct nh_queue *queues;
+	int 		size;
+	int 		num_queues;
+	int 		hash[NH_HASH_SIZE];
+	int 		backlogged;	//queues with frames waiting
+	uint8_t 	scheduled;
+};
+
+struct rpf_state{
+	unsigned long 	flooded;	//came in over our route back to the source
+	unsigned long 	suppressed;	//came in from anywhere else, dropped unseen
+	unsigned long 	unknown;	//no route or L2 address to check against, flooded
+};
+
+struct arp_cache{
+	struct arp_entry *entries;
+	int 		size;
+	int 		num_entries;
+	int 		*hash;		//bucket heads, twice the table size
+	int 		hash_size;
+	int 		free_list;
+	int 		num_waiting;	//over every entry
+	unsigned long 	hits;
+	unsigned long 	queued;
+	unsigned long 	queue_drops;
+	unsigned long 	requests;
+	unsigned long 	responses;
+	unsigned long 	failures;
+	unsigned long 	refreshes;	//in use entries asked again before expiring
+	unsigned long 	prefetches;	//lookups started for a new route's next hop
+	struct token_bucket glean_bucket;	//new or changed gleaned mappings
+	unsigned long 	gleaned;
+	unsigned long 	glean_limited;
+};
+
+struct fcmp_source{
+	uint8_t 	valid;
+	fnaddr_t 	src;		//where the dropped frames came from
+	struct token_bucket bucket;
+	unsigned long 	sent;
+	unsigned long 	suppressed;
+};
+
+struct fcmp_limiter{
+	struct token_bucket global;
+	struct fcmp_source sources[FCMP_SOURCES];
+	unsigned long 	sent[FCMP_KINDS];
+	unsigned long 	suppressed_source[FCMP_KINDS];
+	unsigned long 	suppressed_global[FCMP_KINDS];
+};
+
+/* takes the l4 part of a frame for us (or broadcast), returns L3_PASS or L3_CONSUMED */
+typedef int (*l3_proto_handler)(void *l4frame, int len, fnaddr_t src);
+
+struct l3_dispatch{
+	l3_proto_handler handlers[L3_PROTOS];	//NULL goes straight to l4
+	unsigned long 	delivered[L3_PROTOS];
+	unsigned long 	consumed[L3_PROTOS];
+};
+
+/* a knob that can be changed from the command line with "set <name> <value>" */
+struct fishnode_setting{
+	const char 	*name;
+	int 		*value;
+	int 		min;
+	int 		max;
+	const char 	*help;
+};
+
 
 
 /* functions */
+void l3_register_handler(uint8_t proto, l3_proto_handler handler);
+void print_my_l3_dispatch();
 void add_neighbor_to_table(fnaddr_t neigh);
+void dv_entry_changed(struct dv_entry *entry);
+int find_dv_dest(fnaddr_t dest, fnaddr_t netmask);
+void dv_alternates_flush();
+void refresh_adv_cache();
+void queue_dv_packet(void *dv_frame, fnaddr_t dv_packet_source, int len);
+void run_dv_batch();
+void rib_store_advertisements(fnaddr_t neighbor, struct dv_adv *advertisement, int num_adv);
+void age_rib_in();
+void dv_select_alternate(fnaddr_t dest, fnaddr_t netmask);
+int find_neighbor(fnaddr_t address);
+void process_fast_hello(void *hello_frame, fnaddr_t source, int len);
+void send_neigh_request(fnaddr_t dest);
+int is_advertised(int index);
+void fill_adv_candidate(struct adv_candidate *cand, int index, fnaddr_t neighbor);
+void send_adv_candidates(struct adv_candidate *cands, int num_cands, fnaddr_t dst_addr);
+void *pool_get();
+void *frame_hold(void *frame, int len);
+struct pool_buf *pool_buf_of(const void *frame);
+void frame_release(void *frame);
+void *pkt_init(struct pkt_buf *pkt, int len);
+void pkt_wrap(struct pkt_buf *pkt, void *payload, int len);
+void *pkt_push(struct pkt_buf *pkt, int header_len);
+void pkt_release(struct pkt_buf *pkt);
+int l3_send_pkt(struct pkt_buf *pkt, fnaddr_t dst_addr, uint8_t proto, uint8_t ttl);
+int rx_batch_add(void *l3frame, int len);
+int l3_forward_to(void *l3frame, int len, fnaddr_t next_hop);
+int fcmp_error(void *l3frame, int len, uint32_t error);
+void lpm_batch(fnaddr_t *addrs, fnaddr_t *best_matches, int count);
+int fwd_pipeline_take(void *l3frame, int len);
+void fwd_pipeline_apply();
+void fwd_pipeline_stop();
+int my_fishnode_l2_receive(void *l2frame);
+int l2_transmit(struct pkt_buf *pkt, fn_l2addr_t dest);
+uint32_t fnaddr_hash(fnaddr_t addr);
+void my_arp_received(void *l2frame);
+int arp_cached(fnaddr_t addr);
+int rpf_accept(fnaddr_t src, const fn_l2addr_t *from);
+void print_my_rpf();
+void arp_glean_frame(fn_l2addr_t l2addr, struct fishnet_l3_header *l3_header);
+int token_bucket_take(struct token_bucket *bucket, int rate, int burst, uint64_t now);
+int token_bucket_take_n(struct token_bucket *bucket, int rate, int burst, int cost, uint64_t now);
+int my_fish_l2_send(void *l3frame, fnaddr_t next_hop, int len);
+int l2_output(void *held, fnaddr_t next_hop, int len);
+void egress_init();
+void egress_drain();
+void print_my_egress();
+int nh_queue_send(void *l3frame, int len, fnaddr_t next_hop);
+void nh_pace_tick();
+void print_my_nh_queues();
 /* base functionality */
 int my_fishnode_l3_receive(void *l3frame, int len);
 int my_fish_l3_send(void *l4frame, int len, fnaddr_t dst_addr, uint8_t proto, uint8_t ttl);